@@ -38,6 +38,8 @@
 *
 *********************************************************************************
  * Ports      
+ * CO2 PWM output  D8 (ICP1, only with CO2_PWM_INPUT)
+ * CO2 supply switch  D4 (only with CO2_POWER_GATING)
  * SDARTC   A4 (default)
  * SCLKRTC  A5 (default)
  * IRReceive D7
@@ -52,6 +54,8 @@
 #define INPUT_LDR A0
 const byte INPUT_DOOR     = 2;
 const byte OUTPUT_CO2INIT = 3;
+const byte INPUT_CO2PWM   = 8;     // ICP1, the input capture pin of timer 1
+const byte OUTPUT_CO2POWER = 4;    // high switches the supply of the sensor on
 
 
 
@@ -60,9 +64,43 @@ const byte OUTPUT_CO2INIT = 3;
 /********************************************************************************/
 const byte RUN = 1;
 const byte CMD = 2;
+const byte LEARN = 3;
 const byte ERROR_DOOR_OPEN   = 1;
 const byte ERROR_TIMEOUT_CO2 = 2;
 const byte EVENT_DOOR_CLOSE  = 3; 
+const byte ERROR_CHECKSUM_CO2 = 4;
+
+/********************************************************************************
+ * Flash tables                                                                 *
+ * On the AVR, const data is copied to RAM at start up unless it is placed in
+ * flash with PROGMEM. Flash can only be read with the pgm_read_* functions.
+ * FlashTable wraps a PROGMEM array so it can be indexed like a normal array:
+ *   const FlashTable<byte, 3> TABLE PROGMEM = {{1, 2, 3}};
+ *   byte b = TABLE[1];
+ * flashRead() picks the right pgm_read_* for the type, structures are copied
+ * with memcpy_P. A table is never read directly, only through operator[].
+ ********************************************************************************/
+#include <avr/pgmspace.h>
+
+template <typename T> inline T flashRead(const T *address)
+{
+  T value;
+  memcpy_P(&value, address, sizeof(T));
+  return value;
+}
+template <> inline byte     flashRead(const byte *address)     { return pgm_read_byte(address);  }
+template <> inline char     flashRead(const char *address)     { return pgm_read_byte(address);  }
+template <> inline uint16_t flashRead(const uint16_t *address) { return pgm_read_word(address);  }
+template <> inline int16_t  flashRead(const int16_t *address)  { return pgm_read_word(address);  }
+template <> inline uint32_t flashRead(const uint32_t *address) { return pgm_read_dword(address); }
+
+template <typename T, size_t N> struct FlashTable
+{
+  T data[N];    // only public to allow the initialisation of the table
+
+  T operator[](size_t index) const { return flashRead(&data[index]); }
+  constexpr size_t size() const { return N; }
+};
 
 /********************************************************************************
  * Software timer values                                                        *
@@ -71,6 +109,7 @@ const byte EVENT_DOOR_CLOSE  = 3;
  * Timer 1  Read the CO2 level                                                  *
  * Timer 2  Read the time from the RTC 
  * Timer 3  Command time out                              
+ * Timer 4  Blink of the forecast warning on led 61
  *  The software timers use hardware timer 1. 
  * The tick is ste to 500 ms, as this is more than detailed enough for the
  *  tasks at hand and will decrease codesize and power.
@@ -105,7 +144,7 @@ const byte EVENT_DOOR_CLOSE  = 3;
 const unsigned int T1_COUNT = 34286;
 const byte TCCR1B_INIT = 4;
 
-const byte NUMBER_OF_TIMERS = 4;
+const byte NUMBER_OF_TIMERS = 5;   // Timer numbers are also the data of an EVT_TIMER event
 const unsigned int TICK = 500;   //Tick is 500 ms
 typedef struct 
     {
@@ -114,12 +153,108 @@ typedef struct
     bool Over;
     byte InitialValue;
     } Timer;
-Timer g_timers[NUMBER_OF_TIMERS];
+volatile Timer g_timers[NUMBER_OF_TIMERS];    // shared with the timer interrupt
 
 const byte  Timer0Value =  2000 /TICK ; //Timer 0, 2 second timeout on the Co2 sensor
 const byte  Timer1Value =  5000 /TICK;  //Timer 1 used to read the CO2 level, every 60 seconds One minute value is 120
 const byte  Timer2Value = 15000 /TICK;  //Timer 2 used for a to update the clock from the RTC
 const byte  Timer3Value =  6000 /TICK;  //Timer 3 used for Command time out. After this time, mode returns to "RUN" 
+const byte  Timer4Value =   500 /TICK;  //Timer 4 used to blink the forecast warning
+
+/********************************************************************************
+ * PWM acquisition of the CO2 level                                             *
+ * Build with -DCO2_PWM_INPUT (or uncomment the define below) to read the CO2 
+ * level from the PWM output of the MH-Z19 instead of the serial port. The 
+ * serial port is then free for other use.
+ * The PWM output has a period of 1004 ms:
+ *   high 2 ms + (ppm / range) * 1000 ms, low the rest of the period.
+ *   ppm = range * (TH - 2 ms) / (TH + TL - 4 ms)
+ * Both edges are time stamped by the input capture unit of timer 1 (ICP1, D8)
+ * in an interrupt, the main loop only picks up the result.
+ * Timer 1 runs in CTC mode instead of the reload on overflow, so the counter 
+ * wraps cleanly at 31250 counts. The tick interrupt moves to compare match A
+ * and counts the ticks to extend the time stamps beyond 500 ms. A time stamp 
+ * is ticks * 31250 + capture, so it wraps at PWM_STAMP_RANGE together with the
+ * 16 bit tick count; differences are taken modulo that range.
+ *
+ * TCCR1B
+ *        |** 7 **|** 6 **|** 5 **|** 4 **|** 3 **|** 2 **| ** 1 **|** 0 **|
+ *        | ICNC1 | ICES1 |   0   | WGM13 | WGM12 | CS12  |  CS11  | CS10  |
+ *            1      1        0       0      1       1        0       0
+ *         noise cancel, rising edge  CTC mode, TOP OCR1A   clock select f/256
+ * TIMSK1: ICIE1 and OCIE1A set.
+ ********************************************************************************/
+//#define CO2_PWM_INPUT
+
+#ifdef CO2_PWM_INPUT
+const unsigned int  T1_TOP          = 31250 - 1;               // 500 ms at 62.5 kHz
+const byte          TCCR1B_PWM      = (1 << ICNC1) | (1 << ICES1) | (1 << WGM12) | (1 << CS12);
+const unsigned int  CO2_PWM_RANGE   = 5000;                    // ppm, range set in the sensor
+const unsigned int  PWM_COUNTS_2MS  = 125;                     // 2 ms in timer counts of 16 us
+const uint32_t      PWM_PERIOD      = 62750;                   // 1004 ms in timer counts
+const uint32_t      PWM_PERIOD_MARGIN = PWM_PERIOD / 20;       // the sensor allows +/- 5%
+const uint32_t      PWM_STAMP_RANGE = 65536UL * (T1_TOP + 1);  // time stamps wrap with g_tickCount, every 9.1 h
+
+volatile uint16_t     g_tickCount;        // ticks of timer 1, extends the capture time stamps
+volatile uint32_t     g_pwmLastEdge;      // time stamp of the last edge
+volatile uint32_t     g_pwmHighTime;      // length of the last high period
+volatile unsigned int g_pwmInvalid;       // periods out of the specification
+unsigned int          g_co2PwmLevel;      // last level, delivered by EVT_CO2
+bool                  g_co2PwmReady;      // a new level is available
+#endif
+
+/********************************************************************************
+ * Event queue                                                                  *
+ * The interrupts pass their work to loop() through a fixed size queue:
+ *   EVT_TIMER  a software timer expired             data: timer number
+ *   EVT_DOOR   the door switch changed (INT0)       data: none
+ *   EVT_IR     the IR receiver has a complete frame data: none
+ *   EVT_CO2    a PWM period was measured            data: CO2 level in ppm
+ *   EVT_TICK   ticks passed, for the energy account data: none
+ * loop() takes the events out and only runs the handlers that have work. 
+ * When the queue is empty the CPU sleeps until the next interrupt.
+ * There is one producer and one consumer: interrupts do not nest on the AVR,
+ * so all interrupt routines together are the producer. The producer only 
+ * writes the head, the consumer only writes the tail, so no lock is needed.
+ * loop() posts with interrupts off, which makes it part of the producer.
+ * Door, IR, CO2 and tick events are only posted when the same type is not 
+ * already waiting, so bouncing contacts cannot fill the queue. getEvent() 
+ * clears the waiting bit and frees the entry in one step with interrupts off,
+ * so an event posted right after is not taken for the one still waiting.
+ * The tick interrupt counts the ticks in g_pendingTicks and one EVT_TICK takes
+ * all of them, so the queue does not fill up while loop() is held up (the 
+ * start up animation, an open door). Each timer posts once per start, so with
+ * 5 timers the queue stays below 10 entries and a timer event is never lost;
+ * overflows are counted anyway.
+ * g_command, g_runMode and g_showDisplay are only used in loop(), they do not 
+ * need protection.
+ * In the serial mode the frame of the sensor is completed by the receive 
+ * interrupt of the Arduino core, which cannot post. loop() checks the serial 
+ * buffer, but only while a request is waiting for its response.
+ ********************************************************************************/
+#include <avr/sleep.h>
+
+const byte EVT_TIMER = 0;
+const byte EVT_DOOR  = 1;
+const byte EVT_IR    = 2;
+const byte EVT_CO2   = 3;
+const byte EVT_TICK  = 4;
+const byte EVENT_QUEUE_SIZE = 16;       // must be a power of 2
+const byte EVENT_QUEUE_MASK = EVENT_QUEUE_SIZE - 1;
+
+typedef struct 
+    {
+    byte         type;
+    unsigned int data;
+    } Event;
+
+volatile Event        g_eventQueue[EVENT_QUEUE_SIZE];
+volatile byte         g_eventHead;          // next free entry, written by the producer
+volatile byte         g_eventTail;          // oldest entry, written by the consumer
+volatile byte         g_eventsWaiting;      // bit per type of a waiting door, IR or CO2 event
+volatile unsigned int g_eventOverflows;     // events lost on a full queue
+volatile byte         g_eventPeak;          // highest number of waiting events
+volatile unsigned int g_pendingTicks;       // ticks not yet taken by an EVT_TICK
 
 /********************************************************************************
  * Neopixel parameters                                                          *
@@ -140,21 +275,208 @@ const byte  Timer3Value =  6000 /TICK;  //Timer 3 used for Command time out. Aft
 #include <Adafruit_NeoPixel.h>
 #define PIN 6
 
-Adafruit_NeoPixel strip = Adafruit_NeoPixel(61, PIN, NEO_GRB + NEO_KHZ800);
+const byte NUMBER_OF_PIXELS = 61;
+Adafruit_NeoPixel strip = Adafruit_NeoPixel(NUMBER_OF_PIXELS, PIN, NEO_GRB + NEO_KHZ800);
 uint32_t g_ringColour;
 
 const unsigned long COLOUR_RED    = 0x0FF0000;
 const unsigned long COLOUR_GREEN  = 0x00FF00 ;
 const unsigned long COLOUR_BLUE   = 0x0000FF ;
 const unsigned long COLOUR_ORANGE = 0x00FF00 ;       //re-defined as green.
+const unsigned long COLOUR_WARN   = 0xFF8000 ;       // real orange, forecast of 1000 ppm
 
 bool g_showDisplay;    // If false, display will not be shown. (used in clock and runtime command handler)
+byte g_errorShown;     // error code on the rings, led 61 is red until the clock is drawn again
 const byte RING1 =  0;
 const byte RING2 = 24;
 const byte RING3 = 40;
 const byte RING4 = 52;
 const byte RING5 = 60;
 
+/********************************************************************************
+ * LED current limiter                                                          *
+ * A WS2812 channel draws about 20 mA at full value, and a pixel about 1 mA
+ * when it is dark. 61 pixels at full white would take 3.7 A, far more than a 
+ * USB supply gives. showFrame() estimates the current of every frame before
+ * it is sent and lowers the brightness when it is above the budget.
+ * strip.setBrightness() rescales the pixel buffer and loses the low bits, so
+ * the dimmed frame is only sent: the buffer is copied before and put back 
+ * after the transfer, and later partial redraws still match the picture.
+ * The budget leaves about 100 mA of a 500 mA USB port for the rest of the board.
+ ********************************************************************************/
+const unsigned int LED_CHANNEL_MA     = 20;      // mA of one channel at 255
+const unsigned int LED_IDLE_CURRENT   = 61;      // mA for 61 dark pixels
+const unsigned int LED_CURRENT_BUDGET = 400;     // mA
+
+typedef struct
+    {
+    unsigned int  last;            // mA of the last frame
+    unsigned int  peak;            // highest estimate (after limiting)
+    unsigned int  meanX16;         // running mean over the frames, times 16
+    unsigned long limitedFrames;   // frames that were dimmed
+    } LedCurrent;
+
+LedCurrent g_ledCurrent;
+
+
+/********************************************************************************
+ * Frame transmission                                                           *
+ * strip.show() keeps the interrupts off for about 1.9 ms for 61 pixels. An IR
+ * frame that is received in that time loses its timing and gives a wrong key
+ * or none at all. showFrame() holds a frame back while the IR receiver is in 
+ * the middle of a frame, flushFrame() sends it from the main loop as soon as 
+ * the receiver is idle again. When the receiver does not get idle (noise, 
+ * sunlight on the sensor) the frame is sent anyway after FRAME_MAX_DEFER ms.
+ * The tick interrupt can be up to 1.9 ms late as well. Timer 1 is reloaded by
+ * adding to the counter, so the counts after the overflow are kept and the 
+ * software timers do not drift. In CTC mode (CO2_PWM_INPUT) the hardware 
+ * restarts the counter, so nothing is lost there.
+ ********************************************************************************/
+const unsigned int FRAME_MAX_DEFER = 150;      // ms, two NEC frames (68 ms)
+const byte         T1_COUNT_US     = 16;       // us per count of timer 1
+
+typedef struct
+    {
+    bool                  pending;             // a frame waits to be sent
+    unsigned long         since;               // millis() when the frame became pending
+    unsigned long         deferredFrames;      // showFrame() calls held back for IR
+    unsigned int          forcedFrames;        // sent after FRAME_MAX_DEFER, IR still busy
+    volatile bool         irHeld;              // a frame was held during this IR frame
+    volatile unsigned int protectedIrFrames;   // IR frames received while a frame was held
+    volatile unsigned int maxTickLate;         // counts of timer 1 the tick interrupt was late
+    } FrameSync;
+
+FrameSync g_frameSync;
+
+
+/********************************************************************************
+ * Energy account                                                               *
+ * Every tick the estimated charge of each part of the clock is added to the 
+ * account of the mode the clock is in:
+ *   ENERGY_OFF    display switched off with "*"
+ *   ENERGY_CLOCK  the normal clock
+ *   ENERGY_VIEW   date, CO2 level, statistics or ventilation shown
+ *   ENERGY_CMD    command mode, setting the time or learning a remote
+ * Parts:
+ *   ENERGY_MCU    awake time from micros() around the sleep in loop(), 
+ *                 at MCU_ACTIVE_MA awake and MCU_IDLE_MA asleep
+ *   ENERGY_LED    the estimated current of the last frame sent to the ring
+ *   ENERGY_SENSOR SENSOR_MA while the sensor is powered
+ *   ENERGY_I2C    I2C_TRANSACTION_MAMS for every transaction with the RTC
+ * The charge is kept in mAs, the remainder in mA*ms, so nothing is lost on
+ * the way. The currents are typical values of the data sheets, the account 
+ * is meant to compare modes and timer settings, not to measure.
+ * KEY_DOWN prints the account with the diagnostics.
+ ********************************************************************************/
+const byte ENERGY_OFF   = 0;
+const byte ENERGY_CLOCK = 1;
+const byte ENERGY_VIEW  = 2;
+const byte ENERGY_CMD   = 3;
+const byte NUMBER_OF_ENERGY_MODES = 4;
+
+const byte ENERGY_MCU    = 0;
+const byte ENERGY_LED    = 1;
+const byte ENERGY_SENSOR = 2;
+const byte ENERGY_I2C    = 3;
+const byte NUMBER_OF_ENERGY_PARTS = 4;
+
+const unsigned int MCU_ACTIVE_MA       = 10;    // ATmega328P, 16 MHz, 5 V
+const unsigned int MCU_IDLE_MA         = 3;     // idle sleep, timers running
+const unsigned int SENSOR_MA           = 20;    // MH-Z19 average
+const unsigned int I2C_TRANSACTION_MAMS = 3;    // mA*ms, about 1 ms at 100 kHz
+
+// What the ring shows in RUN mode with the display on
+const byte DISPLAY_CLOCK = 0;
+const byte DISPLAY_VIEW  = 1;
+byte g_displayMode;
+
+typedef struct
+    {
+    unsigned long mAs;
+    unsigned int  mAms;              // remainder, below 1000
+    } Charge;
+
+typedef struct
+    {
+    unsigned long ticks;
+    unsigned long awakeMs;
+    unsigned long i2cTransactions;
+    Charge        charge[NUMBER_OF_ENERGY_PARTS];
+    } EnergyAccount;
+
+typedef struct
+    {
+    unsigned long sleptUs;           // asleep since the last tick, loop() only
+    byte          i2cPending;        // transactions since the last tick
+    EnergyAccount account[NUMBER_OF_ENERGY_MODES];
+    } Energy;
+
+Energy g_energy;
+
+
+/********************************************************************************
+ * Sensor power gating                                                          *
+ * Build with -DCO2_POWER_GATING (or uncomment the define below) when the 
+ * supply of the sensor goes through a switch on OUTPUT_CO2POWER (high side 
+ * switch, pull-down on the gate drive so the sensor is off during a reset).
+ * During the day the sensor is on all the time. At night it only runs a 
+ * sampling window every GATING_PERIOD:
+ *
+ *   OFF ----------------> WARMUP ----------------> SAMPLING ----> OFF ...
+ *       GATING_OFF_TICKS         SENSOR_WARMUP_TICKS      GATING_WINDOW_TICKS
+ *
+ * The sensor is switched on SENSOR_WARMUP_TICKS before the window, so the 
+ * warm up runs while the clock goes on with its own work. Readings that 
+ * were requested or measured while the sensor was warming up are counted 
+ * and dropped, also when they come in after the window opened. None are 
+ * requested while it is off. The forecast and the ventilation estimate need a reading every
+ * few seconds, they start again in the morning.
+ * The hour and day statistics count in SAMPLE_TIMEs. A reading stands for 
+ * the time since the reading before, so the first one of a window also 
+ * covers the time the sensor was off and the minutes above the limits are 
+ * not under-reported at night.
+ * The ticks the sensor is off give the saving: off time * SENSOR_MA. The 
+ * counters of today and yesterday are kept, they roll over at midnight (local
+ * time). KEY_DOWN prints them with the diagnostics.
+ * The serial TX line idles high, a 1k resistor in series keeps it from 
+ * feeding the sensor while its supply is off.
+ ********************************************************************************/
+//#define CO2_POWER_GATING
+
+#ifdef CO2_POWER_GATING
+const byte          GATING_NIGHT_START  = 23;                  // hour, local time
+const byte          GATING_NIGHT_END    = 7;
+const unsigned int  GATING_PERIOD_TICKS = 600000UL / TICK;     // a sampling window every 10 minutes
+const unsigned int  SENSOR_WARMUP_TICKS = 180000UL / TICK;     // MH-Z19B preheat, 3 minutes
+const unsigned int  GATING_WINDOW_TICKS =  30000UL / TICK;     // 6 readings with Timer 1
+const unsigned int  GATING_OFF_TICKS    = GATING_PERIOD_TICKS - SENSOR_WARMUP_TICKS - GATING_WINDOW_TICKS;
+static_assert(GATING_PERIOD_TICKS > SENSOR_WARMUP_TICKS + GATING_WINDOW_TICKS, "the period must be longer than warm up and window");
+static_assert(GATING_PERIOD_TICKS / Timer1Value < 256, "the samples of a reading must fit in a byte");
+
+const byte SENSOR_ON       = 0;        // day time, always on
+const byte SENSOR_OFF      = 1;
+const byte SENSOR_WARMUP   = 2;        // on, readings are dropped
+const byte SENSOR_SAMPLING = 3;
+
+const byte TODAY     = 0;
+const byte YESTERDAY = 1;
+
+typedef struct
+    {
+    byte          state;
+    unsigned int  countdown;           // ticks left in OFF, WARMUP or SAMPLING
+    byte          day;                 // local day of the TODAY counters
+    unsigned long offTicks[2];         // ticks with the sensor switched off
+    unsigned int  powerUps[2];
+    unsigned int  discarded;           // readings dropped during the warm up
+    unsigned int  sinceReading;        // ticks since the last reading that was used
+    bool          warmReading;         // the next reading was taken during the warm up
+    bool          warmPeriod;          // the last PWM period ended during the warm up
+    } SensorPower;
+
+SensorPower g_sensorPower;
+#endif
+
 
 /********************************************************************************/
 /* RTC parameters and libraries                                                 */
@@ -174,6 +496,55 @@ typedef struct
 
 localTimeStruct g_localTime;
 
+/********************************************************************************
+ * Time zone and daylight saving time                                           *
+ * The RTC runs on UTC, g_localTime holds the local time. 
+ * The EU rules are used: summer time starts on the last Sunday of March and 
+ * ends on the last Sunday of October, both at 01:00 UTC.
+ * The days of the changes are calculated by the compiler for DST_YEARS years 
+ * and stored in a flash table, so finding the offset is a table lookup.
+ * Outside the table the standard offset is used.
+ * The day of the week uses the method of Sakamoto, all constexpr.
+ ********************************************************************************/
+const byte TZ_STANDARD_OFFSET = 1;     // CET,  hours ahead of UTC
+const byte TZ_SUMMER_OFFSET   = 2;     // CEST, hours ahead of UTC
+const byte DST_SWITCH_HOUR    = 1;     // hour (UTC) of both changes
+const int  DST_FIRST_YEAR     = 2022;
+const byte DST_YEARS          = 40;
+
+constexpr byte DOW_OFFSET[12] = {0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4};
+
+// day of the week, 0 is Sunday
+constexpr byte dayOfWeek(int year, byte month, byte day)
+{
+  return (((month < 3) ? year - 1 : year) + ((month < 3) ? year - 1 : year) / 4
+          - ((month < 3) ? year - 1 : year) / 100 + ((month < 3) ? year - 1 : year) / 400
+          + DOW_OFFSET[month - 1] + day) % 7;
+}
+
+// day of the month of the last Sunday in a month of 31 days
+constexpr byte lastSunday(int year, byte month)
+{
+  return 31 - dayOfWeek(year, month, 31);
+}
+
+typedef struct
+    {
+    byte march;      // day summer time starts
+    byte october;    // day summer time ends
+    } DstDays;
+
+#define DST_YEAR(n)    { lastSunday(DST_FIRST_YEAR + (n), 3), lastSunday(DST_FIRST_YEAR + (n), 10) }
+#define DST_DECADE(n)  DST_YEAR(n),     DST_YEAR(n + 1), DST_YEAR(n + 2), DST_YEAR(n + 3), DST_YEAR(n + 4), \
+                       DST_YEAR(n + 5), DST_YEAR(n + 6), DST_YEAR(n + 7), DST_YEAR(n + 8), DST_YEAR(n + 9)
+
+const FlashTable<DstDays, DST_YEARS> DST_TABLE PROGMEM = {{ DST_DECADE(0), DST_DECADE(10), DST_DECADE(20), DST_DECADE(30) }};
+
+static_assert(lastSunday(2022, 3) == 27 && lastSunday(2022, 10) == 30, "DST table calculation is wrong");
+static_assert(lastSunday(2024, 3) == 31 && lastSunday(2024, 10) == 27, "DST table calculation is wrong");
+
+const FlashTable<byte, 12> DAYS_IN_MONTH PROGMEM = {{31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31}};
+
 /********************************************************************************/
 /* Infrared control parameters and libraries                                    */
 /********************************************************************************/
@@ -194,6 +565,120 @@ const byte KEY_OK    = 14;
 const byte KEY_AST   = 15;
 const byte KEY_HASH  = 16;
 const byte NO_CMD   = 100;
+
+/********************************************************************************
+ * IR keymaps                                                                   *
+ * A key is identified by protocol, address and command together, so a TV 
+ * remote with the same commands is not taken for ours:
+ *   code = protocol << 24 | address << 8 | command
+ * Built-in profiles are listed in IR_BUILTIN_KEYS, which only exists at 
+ * compile time. From it the compiler fills IR_HASH_TABLE in flash: every key 
+ * sits in the slot given by irHash(), which needs one multiplication:
+ *   slot = (code * IR_HASH_SEED) >> (32 - bits)
+ * IR_HASH_SEED is chosen (offline, by trying seeds) so that no two built-in 
+ * keys share a slot, the static_assert below checks that. After a change of
+ * the built-in keys a new seed may be needed.
+ * Learned profiles live in EEPROM, in a table of IR_LEARN_SLOTS with open 
+ * addressing: a key goes in the first free slot from its hash on, at most 
+ * IR_LEARN_PROBES slots away. An erased EEPROM is an empty table.
+ * A lookup is one read from flash and at most IR_LEARN_PROBES reads from 
+ * EEPROM. Codes that are in neither table are ignored.
+ * Learn mode: hold OK for command mode, then press "#". Press the keys of 
+ * the new remote in the order of IR_LEARN_ORDER, the outer ring shows how 
+ * far you are. OK of a known remote ends early. "*" in command mode turns 
+ * the outer ring red, a second "*" or OK then forgets all learned keys, any
+ * other key or the time out keeps them.
+ * Frames the IR library could not decode (protocol UNKNOWN, noise or another 
+ * kind of remote) and commands above 0xFF are never looked up or learned.
+ ********************************************************************************/
+typedef struct
+    {
+    uint32_t code;      // protocol, address and command
+    byte     key;       // translated key
+    } IrKey;
+
+// a command above 0xFF (some protocols have 16 bits) does not fit, the code 
+// is made UNKNOWN so it is not looked up or learned
+constexpr uint32_t irCode(byte protocol, uint16_t address, uint16_t command)
+{
+  return(command > 0xFF ? (uint32_t) UNKNOWN << 24
+       : ((uint32_t) protocol << 24) | ((uint32_t) address << 8) | command);
+}
+
+constexpr byte irProtocol(uint32_t code)
+{
+  return(code >> 24);
+}
+
+const uint32_t IR_NO_CODE    = 0xFFFFFFFF;   // empty slot, also erased EEPROM
+const uint32_t IR_HASH_SEED  = 0x6EC9D287;
+const byte     IR_HASH_BITS  = 5;
+const byte     IR_HASH_SLOTS = 1 << IR_HASH_BITS;
+
+constexpr byte irHash(uint32_t code, byte bits)
+{
+  return((uint32_t) (code * IR_HASH_SEED) >> (32 - bits));
+}
+
+// Profile 0: the 17 key remote of the Arduino kits, NEC address 0
+constexpr IrKey IR_BUILTIN_KEYS[] = {
+    {irCode(NEC, 0x00, 0x45), 1},        {irCode(NEC, 0x00, 0x46), 2},
+    {irCode(NEC, 0x00, 0x47), 3},        {irCode(NEC, 0x00, 0x44), 4},
+    {irCode(NEC, 0x00, 0x40), 5},        {irCode(NEC, 0x00, 0x43), 6},
+    {irCode(NEC, 0x00, 0x07), 7},        {irCode(NEC, 0x00, 0x15), 8},
+    {irCode(NEC, 0x00, 0x09), 9},        {irCode(NEC, 0x00, 0x16), KEY_AST},
+    {irCode(NEC, 0x00, 0x19), 0},        {irCode(NEC, 0x00, 0x0D), KEY_HASH},
+    {irCode(NEC, 0x00, 0x18), KEY_UP},   {irCode(NEC, 0x00, 0x08), KEY_LEFT},
+    {irCode(NEC, 0x00, 0x1C), KEY_OK},   {irCode(NEC, 0x00, 0x5A), KEY_RIGHT},
+    {irCode(NEC, 0x00, 0x52), KEY_DOWN}
+    };
+const byte IR_BUILTIN_COUNT = sizeof(IR_BUILTIN_KEYS) / sizeof(IrKey);
+
+// The built-in key that belongs in a slot, or an empty slot
+constexpr IrKey irSlot(byte slot, byte i = 0)
+{
+  return(i == IR_BUILTIN_COUNT ? IrKey{IR_NO_CODE, NO_CMD}
+       : irHash(IR_BUILTIN_KEYS[i].code, IR_HASH_BITS) == slot ? IR_BUILTIN_KEYS[i]
+       : irSlot(slot, i + 1));
+}
+
+// True when no key from i on shares a slot with a later key
+constexpr bool irHashSeparates(byte i, byte j)
+{
+  return(j == IR_BUILTIN_COUNT ? true
+       : irHash(IR_BUILTIN_KEYS[i].code, IR_HASH_BITS) != irHash(IR_BUILTIN_KEYS[j].code, IR_HASH_BITS)
+         && irHashSeparates(i, j + 1));
+}
+constexpr bool irHashIsPerfect(byte i = 0)
+{
+  return(i == IR_BUILTIN_COUNT ? true : irHashSeparates(i, i + 1) && irHashIsPerfect(i + 1));
+}
+static_assert(irHashIsPerfect(), "IR_HASH_SEED puts two built-in keys in one slot, choose another seed");
+static_assert(IR_BUILTIN_COUNT <= IR_HASH_SLOTS, "too many built-in keys for IR_HASH_SLOTS");
+
+const FlashTable<IrKey, IR_HASH_SLOTS> IR_HASH_TABLE PROGMEM = {{
+    irSlot(0),  irSlot(1),  irSlot(2),  irSlot(3),  irSlot(4),  irSlot(5),  irSlot(6),  irSlot(7),
+    irSlot(8),  irSlot(9),  irSlot(10), irSlot(11), irSlot(12), irSlot(13), irSlot(14), irSlot(15),
+    irSlot(16), irSlot(17), irSlot(18), irSlot(19), irSlot(20), irSlot(21), irSlot(22), irSlot(23),
+    irSlot(24), irSlot(25), irSlot(26), irSlot(27), irSlot(28), irSlot(29), irSlot(30), irSlot(31)
+    }};
+
+#include <avr/eeprom.h>
+const byte IR_LEARN_BITS   = 6;
+const byte IR_LEARN_SLOTS  = 1 << IR_LEARN_BITS;   // 320 bytes of EEPROM
+const byte IR_LEARN_MASK   = IR_LEARN_SLOTS - 1;
+const byte IR_LEARN_PROBES = 4;
+IrKey * const IR_LEARN_TABLE = (IrKey *) 0;         // EEPROM address
+
+// Order in which the keys of a new remote are learned, as on the kit remote
+const FlashTable<byte, 17> IR_LEARN_ORDER PROGMEM = {{
+    1, 2, 3, 4, 5, 6, 7, 8, 9, KEY_AST, 0, KEY_HASH,
+    KEY_UP, KEY_LEFT, KEY_OK, KEY_RIGHT, KEY_DOWN
+    }};
+static_assert(IR_LEARN_ORDER.size() == IR_BUILTIN_COUNT, "IR_LEARN_ORDER must hold every built-in key");
+byte g_learnCount;       // keys of the new remote learned so far
+bool g_forgetArmed;      // "*" in command mode, waits for the confirmation
+
 const byte OFF      = 1;
 const byte ON       = 2;
 
@@ -211,12 +696,254 @@ int   g_newYear;
  * CO2 sensor                                                                   *
  ********************************************************************************/
 
-const byte INIT_CO2[]     = {0xFF, 0x01, 0x86, 0x00, 0x00, 0x00, 0x00, 0x00, 0x79};
 const byte INIT_CO2_LENGTH = 9; 
+const FlashTable<byte, INIT_CO2_LENGTH> INIT_CO2 PROGMEM = {{0xFF, 0x01, 0x86, 0x00, 0x00, 0x00, 0x00, 0x00, 0x79}};
 unsigned int g_co2Level;    // value of the CO2 mesurement in ppm
 const byte  CO2_BUFFER_SIZE = 15; 
 
 
+/********************************************************************************
+ * CO2 exposure statistics                                                      *
+ * The statistics are kept for the running hour and the running day. Every
+ * reading is folded into the accumulators, so nothing but the totals is stored.
+ * The blocks are cleared when g_localTime moves into a new hour or day.
+ * Every sample counts for one CO2 read interval (Timer 1), which is used to 
+ * convert the samples above a limit into minutes.
+ * A day has 17280 samples of 5 seconds, which fits the 16 bit counters. The sum
+ * of all samples fits 32 bits up to a mean of 248000 ppm.
+ * KEY_RIGHT shows the figures one after the other on the rings, 
+ * hour: mean, minimum, maximum, minutes > 1000, minutes > 2000 
+ * day:  mean, minimum, maximum, minutes > 1000, minutes > 2000
+ * Led 61 is blue for the hour figures and green for the day figures.
+ ********************************************************************************/
+const unsigned int CO2_LIMIT_WARN  = 1000;
+const unsigned int CO2_LIMIT_ALARM = 2000;
+const unsigned int SAMPLE_TIME     = Timer1Value * TICK;   // ms per CO2 sample
+
+const byte STATS_HOUR      = 0;
+const byte STATS_DAY       = 1;
+const byte NUMBER_OF_STATS = 2;
+const byte STATS_FIGURES   = 5;   // figures shown per block
+
+typedef struct
+    {
+    byte         period;       // hour or day of the month the block belongs to
+    unsigned int count;        // number of samples, of SAMPLE_TIME each
+    uint32_t     sum;          // sum of all samples, mean = sum/count
+    unsigned int minimum;
+    unsigned int maximum;
+    unsigned int aboveWarn;    // samples above CO2_LIMIT_WARN
+    unsigned int aboveAlarm;   // samples above CO2_LIMIT_ALARM
+    } Co2Stats;
+
+Co2Stats g_co2Stats[NUMBER_OF_STATS];
+byte     g_statsFigure;        // next figure shown on KEY_RIGHT
+
+
+/********************************************************************************
+ * Serial telemetry                                                             *
+ * Build with -DSERIAL_TELEMETRY (or uncomment the define below) to send every
+ * reading on the serial port, for tools/collector:
+ *   M,<ppm>,<local hour>,<local minute>
+ * Meant for CO2_PWM_INPUT. In the serial mode the text also reaches the
+ * sensor, which ignores it as it does not start with 0xFF.
+ ********************************************************************************/
+//#define SERIAL_TELEMETRY
+
+
+/********************************************************************************
+ * CO2 forecast                                                                 *
+ * A straight line is fitted through the last FORECAST_WINDOW minutes with 
+ * least squares, to see where the CO2 level is going. The readings are 
+ * averaged per minute first (MINUTE_SAMPLES readings of 5 seconds).
+ * For x = 0..N-1 and readings y:
+ *   S = sum(y), T = sum(x*y)
+ *   slope = (N*T - Sx*S) / (N*Sxx - Sx^2)    with Sx = N(N-1)/2, Sxx = N(N-1)(2N-1)/6
+ * Moving the window one minute on needs no loop: 
+ *   T' = T - (S - y_oldest) + (N-1)*y_new,  S' = S - y_oldest + y_new
+ * The slope is kept in 1/16 ppm per minute. When the level at the end of the
+ * fitted line would reach the next limit (1000 or 2000 ppm) within 
+ * FORECAST_WARN_MINUTES, led 61 blinks in the colour of that limit.
+ ********************************************************************************/
+const byte FORECAST_WINDOW       = 16;        // minutes
+const byte FORECAST_WARN_MINUTES = 10;
+const byte FORECAST_NONE         = 0xFF;      // no limit in sight
+const long FORECAST_SX           = (long) FORECAST_WINDOW * (FORECAST_WINDOW - 1) / 2;
+const long FORECAST_DENOMINATOR  = (long) FORECAST_WINDOW * FORECAST_WINDOW * (FORECAST_WINDOW * FORECAST_WINDOW - 1) / 12;
+
+typedef struct
+    {
+    unsigned int  window[FORECAST_WINDOW];   // minute averages, oldest at index 'oldest'
+    byte          count;                      // minutes in the window
+    byte          oldest;
+    long          sum;                        // S
+    long          weightedSum;                // T
+    int           slopeX16;                   // ppm per minute, times 16
+    unsigned int  limit;                      // next limit, 0 if none
+    byte          minutes;                    // minutes until the limit, FORECAST_NONE if not in sight
+    bool          blinkOn;
+    } Forecast;
+
+Forecast g_forecast;
+
+// Minute averages, used by the forecast and the ventilation estimate
+const byte MINUTE_SAMPLES = 60000UL / SAMPLE_TIME;
+uint32_t   g_minuteSum;                // readings of the current minute
+byte       g_minuteCount;
+
+
+/********************************************************************************
+ * Ventilation rate                                                             *
+ * After the people leave a room, the CO2 level decays towards the outdoor
+ * level: C(t) = Cout + (C0 - Cout) * exp(-ACH * t), ACH in air changes per hour.
+ * So log(C - Cout) falls in a straight line with a slope of -ACH.
+ * A decay episode starts when the minute average drops and lasts as long as 
+ * the level keeps going down (within VENT_NOISE) and stays VENT_MIN_EXCESS
+ * above outdoor. A line is fitted through log2(C - Cout) against the minute 
+ * with least squares, using running sums only. The log2 is in fixed point 
+ * with 8 bits of fraction, from a 16 step table with interpolation.
+ * An episode of at least VENT_MIN_POINTS minutes gives an ACH value, the 
+ * estimate is a running mean over the episodes: new = (3 * old + episode) / 4.
+ * The key "1" shows the estimate in tenths of air changes per hour.
+ ********************************************************************************/
+const unsigned int VENT_OUTDOOR     = 420;   // ppm, outdoor CO2 level
+const unsigned int VENT_MIN_EXCESS  = 100;   // ppm above outdoor, below this the noise wins
+const byte         VENT_NOISE       = 10;    // ppm a minute may rise within an episode
+const byte         VENT_MIN_POINTS  = 10;    // minutes
+const byte         VENT_MAX_POINTS  = 60;    // minutes, keeps the sums within 32 bits
+const long         LN2_X60_X100000  = 4158883; // ln(2) * 60 minutes * 100000
+const byte         KEY_ACH          = 1;     // digit key "1" in RUN mode
+
+// 256 * log2(1 + i/16)
+const FlashTable<uint16_t, 17> LOG2_TABLE PROGMEM = {{0, 22, 44, 63, 82, 100, 118, 134, 150, 165, 179, 193, 207, 220, 232, 244, 256}};
+
+typedef struct
+    {
+    bool          active;                  // in a decay episode
+    unsigned int  previous;                // last minute average
+    byte          points;                  // minutes in the episode
+    long          sumT;                    // sum of t
+    long          sumTT;                   // sum of t*t
+    long          sumY;                    // sum of log2(C - Cout), times 256
+    long          sumTY;                   // sum of t*y
+    unsigned int  achX100;                 // running estimate, 0 if none yet
+    unsigned int  lastAchX100;             // result of the last episode
+    unsigned int  episodes;                // episodes used
+    } Ventilation;
+
+Ventilation g_ventilation;
+
+
+/********************************************************************************
+ * Sensor link health                                                           *
+ * Every request to the sensor is timed, the latency goes into a histogram with
+ * buckets that double in size: bucket n counts latencies from 2^(n-1) to 2^n ms.
+ * 12 buckets cover the full 2 second time out (Timer 0).
+ * A time out with some bytes received is counted as a short read.
+ * With CO2_PWM_INPUT a request is a read of the PWM result, a time out means no
+ * valid period since the last read and a PWM period out of specification is 
+ * counted as a checksum error.
+ * KEY_DOWN prints the counters on the serial port.
+ ********************************************************************************/
+const byte LATENCY_BUCKETS = 12;
+
+typedef struct
+    {
+    unsigned long requests;
+    unsigned int  timeouts;          // no response at all
+    unsigned int  shortReads;        // less than 9 bytes before the time out
+    unsigned int  checksumErrors;    // 9 bytes, but not a valid response
+    unsigned int  maxLatency;        // ms
+    unsigned int  histogram[LATENCY_BUCKETS];
+    } LinkHealth;
+
+LinkHealth g_linkHealth;
+bool          g_co2RequestPending;     // a request was sent, the response is not in yet
+unsigned long g_co2RequestTime;        // micros() when the request was sent
+bool          g_diagnosticsWanted;     // KEY_DOWN during a request, printed after the response
+
+
+/********************************************************************************
+ * Watchdog and warm restart                                                    *
+ * The hardware watchdog resets the board if the main loop stops running, for
+ * instance when the I2C bus to the RTC hangs. A small block of RAM in the
+ * .noinit section is not cleared by the C startup code, so it survives a
+ * watchdog or brown-out reset. It holds a snapshot of the display state and
+ * the restart counters, protected by a CRC. When the snapshot is valid after a
+ * watchdog or brown-out reset, setup() restores it and skips the start up
+ * animation and the 12 second sensor init hold.
+ * The watchdog is set to 8 seconds, the longest possible, to cover the 2 second
+ * sensor time out and the door loop.
+ ********************************************************************************/
+#include <avr/wdt.h>
+#include <util/crc16.h>
+
+const byte WATCHDOG_TIMEOUT = WDTO_8S;
+
+const byte RESET_CAUSE_POWER_ON  = 0;
+const byte RESET_CAUSE_EXTERNAL  = 1;
+const byte RESET_CAUSE_BROWN_OUT = 2;
+const byte RESET_CAUSE_WATCHDOG  = 3;
+const byte NUMBER_OF_RESET_CAUSES = 4;
+
+typedef struct
+    {
+    unsigned int co2Level;                         // last CO2 value in ppm
+    uint32_t     ringColour;                       // colour of the ring for that value
+    bool         showDisplay;                      // display on or off (KEY_AST / KEY_HASH)
+    byte         brightness;                       // last brightness set by the LDR
+    unsigned int resetCount[NUMBER_OF_RESET_CAUSES]; // restarts per cause
+    unsigned int crc;                              // CRC16 over all fields above
+    } WarmState;
+
+WarmState g_warmState  __attribute__ ((section (".noinit")));
+byte      g_mcusrCopy  __attribute__ ((section (".noinit")));  // MCUSR, saved before it is cleared
+byte      g_resetCause;
+
+
+/********************************************************************************
+ * Kernel profiling                                                             *
+ * Build with -DPROFILE_KERNELS (or uncomment the define below) to time the
+ * time critical parts of the firmware on the real ATmega328P. Every profiled 
+ * kernel keeps the number of calls, the total and the maximum run time.
+ * The time base is micros(), which has a resolution of 4 us (64 cycles), and
+ * the time of updateClock() is mostly the I2C read of the RTC. For cycle 
+ * counts of the kernels themselves use the simavr bench in tools/bench.
+ * The free stack that was never touched is measured by painting the RAM 
+ * between the heap and the stack at start up.
+ * KEY_DOWN prints the results on the serial port with the diagnostics:
+ *   P,<kernel>,<calls>,<mean cycles>,<max cycles>
+ *   S,<untouched stack bytes>
+ * Without the define the macros are empty and cost nothing.
+ ********************************************************************************/
+//#define PROFILE_KERNELS
+
+#ifdef PROFILE_KERNELS
+const byte PROFILE_SET_COLOR    = 0;
+const byte PROFILE_UPDATE_CLOCK = 1;
+const byte PROFILE_RECEIVE_IR   = 2;
+const byte PROFILE_TIMER_ISR    = 3;
+const byte NUMBER_OF_PROFILES   = 4;
+const byte CYCLES_PER_MICRO     = F_CPU / 1000000UL;
+const byte STACK_PAINT          = 0xC5;
+
+typedef struct
+    {
+    unsigned long calls;
+    unsigned long totalMicros;
+    unsigned long maxMicros;          // EEPROM writes in learn mode take longer than 65 ms
+    } KernelProfile;
+
+KernelProfile g_profile[NUMBER_OF_PROFILES];
+
+#define PROFILE_START()   unsigned long profileStart = micros()
+#define PROFILE_END(k)    profileAdd((k), micros() - profileStart)
+#else
+#define PROFILE_START()
+#define PROFILE_END(k)
+#endif
+
+
 /********************************************************************************
  * End of delcations                                                            *
  ********************************************************************************/
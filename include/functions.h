@@ -41,6 +41,103 @@
 
 
 
+#ifdef PROFILE_KERNELS
+/*Function *************************************************************
+ * Name:    profileAdd
+ * purpose: adds one run of a kernel to its profile. It is also called from
+ *          the timer interrupt, so the update is done with interrupts off.
+ * Inputs   kernel number, run time in us
+ * Outputs  none
+ * Updates  g_profile[]
+ */
+void profileAdd(byte kernel, unsigned long runTime)
+{
+  byte oldSREG = SREG;
+  cli();
+  g_profile[kernel].calls++;
+  g_profile[kernel].totalMicros += runTime;
+  if (runTime > g_profile[kernel].maxMicros) g_profile[kernel].maxMicros = runTime;
+  SREG = oldSREG;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    paintStack
+ * purpose: fills the free RAM between the heap and the stack with a known
+ *          pattern. Called once at the start of setup().
+ * Inputs   none
+ * Outputs  none
+ */
+extern byte __heap_start;
+extern byte *__brkval;
+
+void paintStack(void)
+{
+  byte marker;
+  byte *p = (__brkval == 0) ? &__heap_start : __brkval;
+  while (p < &marker - 16)
+    {
+    *p++ = STACK_PAINT;
+    }
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    stackUntouched
+ * purpose: counts the painted bytes the stack never reached.
+ * Inputs   none
+ * Outputs  number of untouched bytes
+ */
+unsigned int stackUntouched(void)
+{
+  const byte *p = (__brkval == 0) ? &__heap_start : __brkval;
+  unsigned int count = 0;
+  while (*p == STACK_PAINT)
+    {
+    p++;
+    count++;
+    }
+  return(count);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    printProfile
+ * purpose: prints the kernel profiles and the stack reserve on the 
+ *          serial port. Times are printed in CPU cycles.
+ * Inputs   none
+ * Outputs  none
+ * Uses     g_profile[]
+ */
+void printProfile(void)
+{
+  for (byte i = 0; i < NUMBER_OF_PROFILES; i++)
+    {
+    KernelProfile profile;
+    byte oldSREG = SREG;
+    cli();
+    profile = g_profile[i];
+    SREG = oldSREG;
+
+    Serial.print(F("P,"));
+    Serial.print(i);
+    Serial.print(',');
+    Serial.print(profile.calls);
+    Serial.print(',');
+    Serial.print(profile.calls ? (profile.totalMicros / profile.calls) * CYCLES_PER_MICRO : 0);
+    Serial.print(',');
+    Serial.println(profile.maxMicros * CYCLES_PER_MICRO);
+    }
+  Serial.print(F("S,"));
+  Serial.println(stackUntouched());
+}
+/***********************************************************************/
+#endif
+
+
 /*Function *************************************************************
  * Name: updateBrightness()
  * purpose  Sets a brightness level depending on the value of ambient light as red by the LDR.
@@ -76,6 +173,138 @@ inline void updateBrightness()
 }
 /***********************************************************************/
 
+/*Function *************************************************************
+ * Name:    irBusy
+ * purpose  tells whether the IR receiver is in the middle of a frame
+ * Inputs   none
+ * Outputs  true between the first mark and the end of a frame
+ * Uses     IrReceiver
+ */
+inline bool irBusy(void)
+{
+  byte state = IrReceiver.irparams.StateForISR;
+  return(state == IR_REC_STATE_MARK || state == IR_REC_STATE_SPACE);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    transmitFrame
+ * purpose  sends the pixel buffer to the ring, after a check on the current.
+ *          An IR frame can start after the check in flushFrame(), so the 
+ *          receiver is checked again with the interrupts off, and they stay
+ *          off until the transfer is done: a busy receiver costs nothing.
+ *          The current is estimated in one pass over the pixel buffer. The
+ *          buffer already holds the values scaled by the brightness, so the
+ *          sum of all channel values times the current of a full channel
+ *          gives the LED current. When the estimate is above the budget the
+ *          brightness is lowered for this frame only: the buffer is copied
+ *          first and put back with the brightness after the transfer.
+ * Inputs   force: send even when the IR receiver is busy
+ * Outputs  true when the frame was sent
+ * Uses     strip
+ * Updates  g_ledCurrent, g_frameSync
+ */
+bool transmitFrame(bool force)
+{
+  byte *pixels = strip.getPixels();
+  byte oldSREG = SREG;
+  cli();
+  if (!force && irBusy())
+    {
+    SREG = oldSREG;
+    return(false);                          // try again from flushFrame()
+    }
+
+  unsigned int channelSum = 0;              // 61 * 3 * 255 still fits
+  for (byte i = 0; i < strip.numPixels() * 3; i++)
+    {
+    channelSum += pixels[i];
+    }
+  unsigned int current = ((uint32_t) channelSum * LED_CHANNEL_MA) / 255 + LED_IDLE_CURRENT;
+
+  bool limited = current > LED_CURRENT_BUDGET;
+  byte brightness = strip.getBrightness();
+  byte saved[NUMBER_OF_PIXELS * 3];
+  if (limited)
+    {
+    // scale the part above the idle current back to the budget, on a copy
+    memcpy(saved, pixels, sizeof(saved));
+    strip.setBrightness(((uint32_t) brightness * (LED_CURRENT_BUDGET - LED_IDLE_CURRENT)) / (current - LED_IDLE_CURRENT));
+    current = LED_CURRENT_BUDGET;
+    }
+  strip.show();
+  // the AVR show() of the library turns the interrupts on when it is done,
+  // the old state is put back so the caller gets what it had
+  SREG = oldSREG;
+  if (limited)
+    {
+    strip.setBrightness(brightness);
+    memcpy(pixels, saved, sizeof(saved));
+    g_ledCurrent.limitedFrames++;
+    }
+
+  g_ledCurrent.last = current;
+  if (current > g_ledCurrent.peak) g_ledCurrent.peak = current;
+  // running mean over the frames, kept with 4 extra bits: mean += (new - mean)/16
+  g_ledCurrent.meanX16 += (int) current - (int) (g_ledCurrent.meanX16 >> 4);
+  g_frameSync.pending = false;
+  return(true);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    flushFrame
+ * purpose  sends a pending frame, unless the IR receiver is busy with a
+ *          frame. After FRAME_MAX_DEFER ms the frame is sent anyway.
+ * Inputs   none
+ * Outputs  true when a frame was sent
+ * Updates  g_frameSync
+ */
+bool flushFrame(void)
+{
+  if (!g_frameSync.pending) return(false);
+  bool force = false;
+  if (irBusy())
+    {
+    if (millis() - g_frameSync.since < FRAME_MAX_DEFER) return(false);
+    force = true;
+    }
+  if (!transmitFrame(force)) return(false);
+  if (force)
+    {
+    g_frameSync.forcedFrames++;
+    g_frameSync.irHeld = false;               // this IR frame is hit anyway
+    }
+  return(true);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    showFrame
+ * purpose  all updates of the ring go through here. The frame is sent 
+ *          straight away, or held back while an IR frame is received. The
+ *          pixel buffer keeps the latest picture, so several held frames 
+ *          are sent as one.
+ * Inputs   none
+ * Outputs  none
+ * Updates  g_frameSync
+ */
+void showFrame(void)
+{
+  if (!g_frameSync.pending) g_frameSync.since = millis();
+  g_frameSync.pending = true;
+  if (!flushFrame())
+    {
+    g_frameSync.deferredFrames++;
+    g_frameSync.irHeld = true;
+    }
+}
+/***********************************************************************/
+
+
 /*Function *************************************************************
  * Name:    setErrorCode
  * purpose  sets an Errorcode on the errorcode leds in Ring 1
@@ -94,11 +323,227 @@ void setErrorCode(byte errorCode)
         else strip.setPixelColor(RING2 + i, 0);
       }
     strip.setPixelColor(RING5, COLOUR_RED); //Set led 61 to red to indicate a problem
-    strip.show();
+    g_errorShown = errorCode;
+    showFrame();
   }
 /***********************************************************************/
 
 
+/*Function *************************************************************
+ * Name:    postEvent
+ * purpose  puts an event in the queue. Only to be called with interrupts
+ *          off: from an interrupt routine, or through postEventFromLoop().
+ *          When the queue is full the event is lost and counted.
+ * Inputs   event type and data
+ * Outputs  none
+ * Updates  g_eventQueue[], g_eventHead, g_eventPeak, g_eventOverflows
+ */
+inline void postEvent(byte type, unsigned int data)
+{
+  byte head = g_eventHead;
+  byte next = (head + 1) & EVENT_QUEUE_MASK;
+  if (next == g_eventTail)
+    {
+    g_eventOverflows++;
+    return;
+    }
+  g_eventQueue[head].type = type;
+  g_eventQueue[head].data = data;
+  g_eventHead = next;                           // publish the event
+  byte depth = (next - g_eventTail) & EVENT_QUEUE_MASK;
+  if (depth > g_eventPeak) g_eventPeak = depth;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    postEventOnce
+ * purpose  posts an event unless an event of the same type is still 
+ *          waiting. Interrupts must be off, as for postEvent().
+ * Inputs   event type and data
+ * Outputs  none
+ * Updates  g_eventsWaiting
+ */
+inline void postEventOnce(byte type, unsigned int data)
+{
+  if (g_eventsWaiting & (1 << type)) return;
+  g_eventsWaiting |= (1 << type);
+  postEvent(type, data);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    postEventFromLoop
+ * purpose  posts an event from the main loop, with interrupts off.
+ * Inputs   event type and data
+ * Outputs  none
+ */
+void postEventFromLoop(byte type, unsigned int data)
+{
+  byte oldSREG = SREG;
+  cli();
+  postEvent(type, data);
+  SREG = oldSREG;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    getEvent
+ * purpose  takes the oldest event from the queue. Only called from loop().
+ * Inputs   pointer to the event to fill in
+ * Outputs  false when the queue is empty
+ * Updates  g_eventTail, g_eventsWaiting
+ */
+inline bool getEvent(Event *event)
+{
+  byte tail = g_eventTail;
+  if (tail == g_eventHead) return(false);
+  event->type = g_eventQueue[tail].type;
+  event->data = g_eventQueue[tail].data;
+  // Clear the waiting bit and free the entry together: with the bit still 
+  // set after the entry is free, a postEventOnce() in between would be lost.
+  byte oldSREG = SREG;
+  cli();
+  if (event->type != EVT_TIMER) g_eventsWaiting &= ~(1 << event->type);
+  g_eventTail = (tail + 1) & EVENT_QUEUE_MASK;  // free the entry
+  SREG = oldSREG;
+  return(true);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    timerTick
+ * purpose  counts down the software timers, called from the timer interrupt
+ *          An expired timer posts an EVT_TIMER event. Every tick is 
+ *          counted in g_pendingTicks, with one EVT_TICK waiting for them.
+ * Inputs   none
+ * Outputs  none
+ * Uses     g_timers[]
+ * Updates  g_pendingTicks
+ */
+inline void timerTick(void)
+{
+    for(byte i=0;i<NUMBER_OF_TIMERS;i++)
+       {
+        if(g_timers[i].Start)
+        {
+         g_timers[i].Count--;
+         if(g_timers[i].Count==0)
+           {
+            g_timers[i].Start=false;
+            g_timers[i].Over=true;
+            postEvent(EVT_TIMER, i);
+           }
+         } 
+        }
+    g_pendingTicks++;
+    postEventOnce(EVT_TICK, 0);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    takePendingTicks
+ * purpose  takes the ticks counted since the last EVT_TICK. Only called 
+ *          from loop().
+ * Inputs   none
+ * Outputs  number of ticks
+ * Updates  g_pendingTicks
+ */
+inline unsigned int takePendingTicks(void)
+{
+  byte oldSREG = SREG;
+  cli();
+  unsigned int ticks = g_pendingTicks;
+  g_pendingTicks = 0;
+  SREG = oldSREG;
+  return(ticks);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    doorChanged
+ * purpose  interrupt routine (INT0) for the door switch
+ */
+void doorChanged(void)
+{
+  postEventOnce(EVT_DOOR, 0);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    irFrameReceived
+ * purpose  called by the IR library from its interrupt when a frame is
+ *          complete and waits for decode()
+ * Updates  g_frameSync, posts EVT_IR
+ */
+void irFrameReceived(void)
+{
+  if (g_frameSync.irHeld)
+    {
+    // the ring would have been updated in the middle of this frame
+    g_frameSync.irHeld = false;
+    g_frameSync.protectedIrFrames++;
+    }
+  postEventOnce(EVT_IR, 0);
+}
+/***********************************************************************/
+
+
+#ifdef CO2_PWM_INPUT
+/*Function *************************************************************
+ * Name:    pwmCapture
+ * purpose  handles an edge on the PWM output of the sensor, called from the
+ *          input capture interrupt. A falling edge ends the high time, a 
+ *          rising edge ends the low time and so a complete period.
+ *          When the capture happened just after the compare match, but 
+ *          before the tick interrupt ran, the tick count is one behind.
+ *          The time stamps wrap at PWM_STAMP_RANGE.
+ * Inputs   none
+ * Outputs  none
+ * Updates  g_pwmLastEdge, g_pwmHighTime, posts EVT_CO2 with the level
+ */
+inline void pwmCapture(void)
+{
+  unsigned int capture = ICR1;
+  uint16_t     ticks   = g_tickCount;
+  if ((TIFR1 & (1 << OCF1A)) && capture < T1_TOP / 2) ticks++;
+  uint32_t edge = (uint32_t) ticks * (T1_TOP + 1) + capture;
+  uint32_t time = (edge >= g_pwmLastEdge) ? edge - g_pwmLastEdge
+                                          : edge + (PWM_STAMP_RANGE - g_pwmLastEdge);   // the tick count wrapped
+  g_pwmLastEdge = edge;
+
+  if (TCCR1B & (1 << ICES1))
+    {
+    // rising edge, the low time just ended
+    uint32_t period = g_pwmHighTime + time;
+    if (period > PWM_PERIOD - PWM_PERIOD_MARGIN && period < PWM_PERIOD + PWM_PERIOD_MARGIN
+        && g_pwmHighTime >= PWM_COUNTS_2MS)
+      {
+      postEventOnce(EVT_CO2, ((uint32_t) CO2_PWM_RANGE * (g_pwmHighTime - PWM_COUNTS_2MS)) / (period - 2 * PWM_COUNTS_2MS));
+      }
+    else
+      {
+      g_pwmInvalid++;
+      }
+    }
+  else
+    {
+    // falling edge, the high time just ended
+    g_pwmHighTime = time;
+    }
+  TCCR1B ^= (1 << ICES1);     // wait for the other edge
+  TIFR1 = (1 << ICF1);        // changing the edge can set the flag, clear it
+}
+/***********************************************************************/
+#endif
+
+
 /*Function *************************************************************
  * Name:    startTimer
  * purpose  starts a software timer
@@ -116,6 +561,22 @@ inline void startTimer(byte timerID)
 /***********************************************************************/
 
 
+/*Function *************************************************************
+ * Name:    forceTimer
+ * purpose  lets a software timer expire now
+ * Inputs   timer number
+ * Outputs  none
+ * Uses     g_timers[]
+ */
+inline void forceTimer(byte timerID)
+{
+    g_timers[timerID].Start = false;
+    g_timers[timerID].Over  = true;
+    postEventFromLoop(EVT_TIMER, timerID);
+}
+/***********************************************************************/
+
+
 /*Function *************************************************************
  * Name:    checkDoor
  * purpose  checks to see if the door is open. If the door is open, everything stops!
@@ -123,6 +584,7 @@ inline void startTimer(byte timerID)
  * Inputs   none
  * Outputs  none
  * Uses     nothing
+ *          The watchdog is fed while waiting for the door to close.
  */
 inline void checkDoor(void)
 {
@@ -134,6 +596,7 @@ inline void checkDoor(void)
       {
         //delay
         delay(500);
+        wdt_reset();        // the loop is not running, so keep the watchdog happy here
       }
   setErrorCode(EVENT_DOOR_CLOSE);                  // show event door closed
     }    
@@ -142,6 +605,90 @@ inline void checkDoor(void)
 
 
 
+/*Function *************************************************************
+ * Name:    isSummerTime
+ * purpose  looks up if summer time applies at a moment in UTC
+ * Inputs   year, month, day, hour in UTC
+ * Outputs  true for summer time
+ * Uses     DST_TABLE
+ */
+bool isSummerTime(int year, byte month, byte day, byte hour)
+{
+  if (year < DST_FIRST_YEAR || year >= DST_FIRST_YEAR + DST_YEARS) return(false);
+  if (month > 3 && month < 10) return(true);
+  if (month == 3)
+    {
+    byte march = DST_TABLE[year - DST_FIRST_YEAR].march;
+    return(day > march || (day == march && hour >= DST_SWITCH_HOUR));
+    }
+  if (month == 10)
+    {
+    byte october = DST_TABLE[year - DST_FIRST_YEAR].october;
+    return(day < october || (day == october && hour < DST_SWITCH_HOUR));
+    }
+  return(false);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    setLocalTime
+ * purpose  converts the time from the RTC (UTC) to g_localTime. The offset 
+ *          is added to the hour, with a carry into the day, month and year.
+ * Inputs   the time in UTC
+ * Outputs  none
+ * Updates  g_localTime
+ */
+inline void setLocalTime(const DateTime &utc)
+{
+  g_localTime.hour   = utc.hour();
+  g_localTime.minute = utc.minute();
+  g_localTime.year   = utc.year();
+  g_localTime.month  = utc.month();
+  g_localTime.day    = utc.day();
+
+  g_localTime.hour += isSummerTime(g_localTime.year, g_localTime.month, g_localTime.day, g_localTime.hour) ?
+                      TZ_SUMMER_OFFSET : TZ_STANDARD_OFFSET;
+  if (g_localTime.hour > 23)
+    {
+    g_localTime.hour -= 24;
+    g_localTime.day++;
+    byte monthDays = DAYS_IN_MONTH[g_localTime.month - 1];
+    if (g_localTime.month == 2 && (g_localTime.year % 4) == 0) monthDays++;   // good until 2100
+    if (g_localTime.day > monthDays)
+      {
+      g_localTime.day = 1;
+      g_localTime.month++;
+      if (g_localTime.month > 12)
+        {
+        g_localTime.month = 1;
+        g_localTime.year++;
+        }
+      }
+    }
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    localToUtc
+ * purpose  converts a local time (from the IR remote or the compiler) to UTC
+ *          for the RTC. Only used when the clock is set.
+ * Inputs   local time
+ * Outputs  time in UTC
+ */
+DateTime localToUtc(const DateTime &local)
+{
+  DateTime utc = local - TimeSpan(TZ_STANDARD_OFFSET * 3600L);
+  if (isSummerTime(utc.year(), utc.month(), utc.day(), utc.hour()))
+    {
+    utc = local - TimeSpan(TZ_SUMMER_OFFSET * 3600L);
+    }
+  return(utc);
+}
+/***********************************************************************/
+
+
 /*Function *************************************************************
  * Name:  updateClock
  * purpose  updates the clock structure every 15 seconds. Then updates the ring
@@ -162,6 +709,7 @@ inline void checkDoor(void)
  * Inputs   none
  * Outputs  none
  * Uses     g_rtc, g_timers[2], g_showDisplay, g_ringColour
+ *          The RTC runs on UTC, setLocalTime() does the conversion.
  * Updates  g_localTime[] 
  *          strip
  */
@@ -169,18 +717,17 @@ inline void updateClock()
 {
  if(g_timers[2].Over)
    {    
+     PROFILE_START();
      // Only update the clock every (Timer 2) seconds
-     DateTime now        =  g_rtc.now();      // read the time
-     g_localTime.hour    = now.hour();
-     g_localTime.minute  = now.minute();
-     g_localTime.year    = now.year();
-     g_localTime.month   = now.month();
-     g_localTime.day     = now.day();
+     setLocalTime(g_rtc.now());          // read the time (UTC) and convert it
+     g_energy.i2cPending++;
     // local kept time structure is updated
     byte minutesMod =  g_localTime.minute/5; // we need that a few times later on
      //update the rings
      if(g_showDisplay)
      {
+      g_displayMode = DISPLAY_CLOCK;
+      g_errorShown  = 0;
       //LED 0 is always on.
       strip.setPixelColor(0,g_ringColour); // Led 0 is always on
       strip.setPixelColor(RING5,0);      // Clear led 61 (it could have turned on because of an error)
@@ -201,119 +748,938 @@ inline void updateClock()
         else strip.setPixelColor(i,0);
         }
 
-      // Set the 12 led ring (Ring 3)
-      for (byte i=0; i< 12 ; i++)
-        {  
-         //Set the 5 minute bloks in the 12 ring, starting at led 40
-         if (i< minutesMod+1) strip.setPixelColor(i+RING3,g_ringColour);
-         else strip.setPixelColor(i+RING3,0)   ; 
-        }
+      // Set the 12 led ring (Ring 3)
+      for (byte i=0; i< 12 ; i++)
+        {  
+         //Set the 5 minute bloks in the 12 ring, starting at led 40
+         if (i< minutesMod+1) strip.setPixelColor(i+RING3,g_ringColour);
+         else strip.setPixelColor(i+RING3,0)   ; 
+        }
+
+      // Set the minute ring (ring 4)
+      for (byte i=0; i< 8; i++)
+        {
+         byte minutesAdd =  2* (g_localTime.minute - (5* minutesMod));
+         // Set the minute blocks in the 8 ring, starting at 52
+         if (minutesAdd > i ) strip.setPixelColor(i+RING4,g_ringColour);
+         else strip.setPixelColor(i+RING4,0)   ; 
+         }  
+      showFrame();   // Update the display
+      }
+     startTimer(2);  // Restart the Timer when done
+     PROFILE_END(PROFILE_UPDATE_CLOCK);
+    }
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    setColorLevel
+ * purpose: converts teh co2level to a color
+ * Inputs
+ * Outputs
+ * Uses
+ * 
+ */
+inline void setColorLevel(int actualCo2Level)
+  {
+    PROFILE_START();
+    byte green, red,blue;
+    if (actualCo2Level <256)
+        {
+          // In this are the colour chnages from blue to green.
+          blue  = 255-actualCo2Level;
+          green = actualCo2Level;
+          red   = 0;
+        }
+    else if(actualCo2Level< 1024 )
+        {
+          // in this range, colour chnages from green to yellow
+          blue  = 0;
+          green = 255;
+          red   = actualCo2Level/4;
+        }
+    else if ( actualCo2Level< 2048)
+        {
+          blue  = 0;
+          green = 128- (actualCo2Level/16) ; 
+          red   = 255;
+          g_showDisplay = true;     // if the CO2 level gets high, override the display of setting.
+        }
+    else 
+       {
+          blue  = 0;
+          green = 0;
+          red   = 255;    // all red
+          g_showDisplay = true;     // if the CO2 level gets high, override the display of setting.
+       }
+    g_ringColour = strip.Color(red, green, blue);   // Set the ring colour based on the CO2 level
+    PROFILE_END(PROFILE_SET_COLOR);
+  }
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    showNumber();
+ * purpose: shows a number of up to 4 digits on the rings, one digit per ring.
+ *          A digit is shown as digit+1 leds, so a 0 is one led.
+ *          The display is cleared first, showFrame() is left to the caller.
+ * Inputs   value to show
+ * Outputs
+ * Uses     g_ringColour
+ */
+void showNumber(unsigned int value)
+{
+byte digits;
+byte displayDigit;
+byte offset = 0;
+
+ strip.clear();
+ if (value > 9999) value = 9999;      // there are only 4 rings
+ digits =4;
+ while (value>0)
+  {
+   displayDigit=value%10 + 1; 
+   value = value/10;
+   switch(digits)
+   {
+     case 4:  offset = 52; break;
+     case 3:  offset = 40; break;
+     case 2:  offset = 24; break;
+     case 1:  offset =  0; break;
+   }
+   for( byte i=0; i< displayDigit; i++){strip.setPixelColor(i+ offset, g_ringColour);}
+   digits--;
+  }
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    clearStats
+ * purpose  starts a new statistics block 
+ * Inputs   the block (STATS_HOUR, STATS_DAY) and the hour or day it is for
+ * Outputs  none
+ * Updates  g_co2Stats[]
+ */
+void clearStats(byte block, byte period)
+{
+  g_co2Stats[block].period     = period;
+  g_co2Stats[block].count      = 0;
+  g_co2Stats[block].sum        = 0;
+  g_co2Stats[block].minimum    = 0xFFFF;
+  g_co2Stats[block].maximum    = 0;
+  g_co2Stats[block].aboveWarn  = 0;
+  g_co2Stats[block].aboveAlarm = 0;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    updateStats
+ * purpose  adds a CO2 sample to the hour and day statistics. Every sample
+ *          costs the same, whatever the number of samples already taken.
+ *          A block is restarted when the hour or the day changes.
+ * Inputs   the CO2 level in ppm, the number of SAMPLE_TIMEs it stands for
+ * Outputs  none
+ * Uses     g_localTime
+ * Updates  g_co2Stats[]
+ */
+inline void updateStats(unsigned int co2Level, byte samples)
+{
+  // A block without samples is (re)started as well, this covers the first sample after a reset.
+  if (g_co2Stats[STATS_HOUR].count == 0 || g_co2Stats[STATS_HOUR].period != g_localTime.hour) clearStats(STATS_HOUR, g_localTime.hour);
+  if (g_co2Stats[STATS_DAY].count  == 0 || g_co2Stats[STATS_DAY].period  != g_localTime.day)  clearStats(STATS_DAY,  g_localTime.day);
+
+  for (byte block = 0; block < NUMBER_OF_STATS; block++)
+    {
+    Co2Stats *stats = &g_co2Stats[block];
+    stats->count += samples;
+    stats->sum   += (uint32_t) co2Level * samples;
+    if (co2Level < stats->minimum)      stats->minimum = co2Level;
+    if (co2Level > stats->maximum)      stats->maximum = co2Level;
+    if (co2Level > CO2_LIMIT_WARN)  stats->aboveWarn  += samples;
+    if (co2Level > CO2_LIMIT_ALARM) stats->aboveAlarm += samples;
+    }
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    showStatsFigure
+ * purpose  shows one of the statistics figures on the rings. Led 61 is blue
+ *          for an hour figure and green for a day figure. Without samples
+ *          nothing but led 61 is shown.
+ * Inputs   figure number, 0-4 hour, 5-9 day 
+ *          (mean, minimum, maximum, minutes > 1000, minutes > 2000)
+ * Outputs  none
+ * Uses     g_co2Stats[]
+ */
+void showStatsFigure(byte figure)
+{
+  byte     block = figure / STATS_FIGURES;
+  Co2Stats *stats = &g_co2Stats[block];
+  unsigned int value = 0;
+
+  if (stats->count > 0)
+    {
+    switch (figure % STATS_FIGURES)
+      {
+      case 0: value = stats->sum / stats->count; break;
+      case 1: value = stats->minimum; break;
+      case 2: value = stats->maximum; break;
+      case 3: value = ((uint32_t) stats->aboveWarn  * SAMPLE_TIME) / 60000UL; break;
+      case 4: value = ((uint32_t) stats->aboveAlarm * SAMPLE_TIME) / 60000UL; break;
+      }
+    }
+  showNumber(value);
+  strip.setPixelColor(RING5, (block == STATS_HOUR) ? COLOUR_BLUE : COLOUR_GREEN);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    updateForecast
+ * purpose  adds a minute average to the forecast window, fits the line 
+ *          again and works out the time until the next limit. The cost does
+ *          not depend on the size of the window.
+ * Inputs   the average CO2 level of the last minute in ppm
+ * Outputs  none
+ * Updates  g_forecast
+ */
+void updateForecast(unsigned int minuteLevel)
+{
+  Forecast *forecast = &g_forecast;
+
+  if (forecast->count < FORECAST_WINDOW)
+    {
+    // still filling the window, the new value gets x = count
+    forecast->weightedSum += (long) forecast->count * minuteLevel;
+    forecast->sum         += minuteLevel;
+    forecast->window[forecast->count++] = minuteLevel;
+    }
+  else
+    {
+    // replace the oldest value, all others move one x down
+    unsigned int oldestLevel = forecast->window[forecast->oldest];
+    forecast->weightedSum += (long) (FORECAST_WINDOW - 1) * minuteLevel - (forecast->sum - oldestLevel);
+    forecast->sum         += (long) minuteLevel - oldestLevel;
+    forecast->window[forecast->oldest] = minuteLevel;
+    forecast->oldest = (forecast->oldest + 1) % FORECAST_WINDOW;
+    }
+
+  forecast->minutes = FORECAST_NONE;
+  forecast->limit   = 0;
+  forecast->slopeX16 = 0;
+  if (forecast->count < FORECAST_WINDOW) return;
+
+  long numerator = FORECAST_WINDOW * forecast->weightedSum - FORECAST_SX * forecast->sum;
+  forecast->slopeX16 = (numerator * 16) / FORECAST_DENOMINATOR;
+  if (forecast->slopeX16 <= 0) return;               // level is not going up
+
+  // level at the end of the line: mean + slope * (N-1)/2
+  long level = forecast->sum / FORECAST_WINDOW + ((long) forecast->slopeX16 * (FORECAST_WINDOW - 1)) / 32;
+  unsigned int limit;
+  if      (level < CO2_LIMIT_WARN)  limit = CO2_LIMIT_WARN;
+  else if (level < CO2_LIMIT_ALARM) limit = CO2_LIMIT_ALARM;
+  else return;                                        // above both limits already
+
+  long minutes = ((limit - level) * 16) / forecast->slopeX16;
+  if (minutes <= FORECAST_WARN_MINUTES)
+    {
+    forecast->limit   = limit;
+    forecast->minutes = minutes;
+    if (!g_timers[4].Start) startTimer(4);           // start blinking
+    }
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    log2X256
+ * purpose  base 2 logarithm in fixed point, 8 bits of fraction. The integer
+ *          part is the position of the highest bit, the fraction comes from
+ *          LOG2_TABLE with linear interpolation (error below 0.002).
+ * Inputs   value, 1 or more
+ * Outputs  256 * log2(value), 0 for a value of 0 (as for 1)
+ */
+unsigned int log2X256(unsigned int value)
+{
+  if (value == 0) return(0);    // no bit to find, the loop below would not end
+  byte msb = 15;
+  while (!(value & 0x8000))
+    {
+    value <<= 1;
+    msb--;
+    }
+  // value now has the top bit set: 1.iiiiffffffff...
+  byte index    = (value >> 11) & 0x0F;
+  byte fraction = (value >> 3) & 0xFF;
+  unsigned int low  = LOG2_TABLE[index];
+  unsigned int high = LOG2_TABLE[index + 1];
+  return((unsigned int) msb * 256 + low + (((high - low) * fraction) >> 8));
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    addDecayPoint
+ * purpose  adds a minute to the running sums of the decay episode
+ * Inputs   minute average, above VENT_OUTDOOR
+ * Outputs  none
+ * Updates  g_ventilation
+ */
+void addDecayPoint(unsigned int level)
+{
+  long t = g_ventilation.points++;
+  long y = log2X256(level - VENT_OUTDOOR);
+  g_ventilation.sumT  += t;
+  g_ventilation.sumTT += t * t;
+  g_ventilation.sumY  += y;
+  g_ventilation.sumTY += t * y;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    startDecay
+ * purpose  starts a decay episode with the previous and the new minute
+ * Inputs   previous and new minute average
+ * Outputs  none
+ * Updates  g_ventilation
+ */
+void startDecay(unsigned int previous, unsigned int level)
+{
+  g_ventilation.active = true;
+  g_ventilation.points = 0;
+  g_ventilation.sumT   = 0;
+  g_ventilation.sumTT  = 0;
+  g_ventilation.sumY   = 0;
+  g_ventilation.sumTY  = 0;
+  addDecayPoint(previous);
+  addDecayPoint(level);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    endDecay
+ * purpose  ends a decay episode. A long enough episode gives a value for
+ *          the air changes per hour:
+ *          slope = (n*Sty - St*Sy) / (n*Stt - St^2), in 1/256 log2 per minute
+ *          ACH   = -slope / 256 * ln(2) * 60
+ *          The 64 bit product is only needed once per episode.
+ * Inputs   none
+ * Outputs  none
+ * Updates  g_ventilation
+ */
+void endDecay(void)
+{
+  g_ventilation.active = false;
+  if (g_ventilation.points < VENT_MIN_POINTS) return;
+
+  long n = g_ventilation.points;
+  long numerator   = n * g_ventilation.sumTY - g_ventilation.sumT * g_ventilation.sumY;
+  long denominator = n * g_ventilation.sumTT - g_ventilation.sumT * g_ventilation.sumT;
+  if (numerator >= 0) return;                  // not a decay after all
+
+  unsigned int achX100 = ((int64_t) -numerator * LN2_X60_X100000) / ((int64_t) denominator * 256 * 1000);
+  g_ventilation.lastAchX100 = achX100;
+  if (g_ventilation.episodes == 0) g_ventilation.achX100 = achX100;
+  else g_ventilation.achX100 = ((unsigned long) g_ventilation.achX100 * 3 + achX100) / 4;
+  g_ventilation.episodes++;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    updateVentilation
+ * purpose  looks for decay episodes in the minute averages and follows
+ *          them. Constant memory and time per minute.
+ * Inputs   the average CO2 level of the last minute in ppm
+ * Outputs  none
+ * Updates  g_ventilation
+ */
+void updateVentilation(unsigned int minuteLevel)
+{
+  unsigned int previous = g_ventilation.previous;
+  g_ventilation.previous = minuteLevel;
+  bool highEnough = (minuteLevel >= VENT_OUTDOOR + VENT_MIN_EXCESS);
+
+  if (g_ventilation.active)
+    {
+    if (highEnough && minuteLevel <= previous + VENT_NOISE)
+      {
+      addDecayPoint(minuteLevel);
+      if (g_ventilation.points >= VENT_MAX_POINTS) endDecay();
+      }
+    else
+      {
+      endDecay();
+      }
+    }
+  else if (highEnough && previous > 0 && minuteLevel < previous)
+    {
+    startDecay(previous, minuteLevel);
+    }
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    addMinuteSample
+ * purpose  averages the readings per minute for the forecast and the 
+ *          ventilation estimate
+ * Inputs   the CO2 level in ppm
+ * Outputs  none
+ * Updates  g_minuteSum, g_minuteCount
+ */
+inline void addMinuteSample(unsigned int co2Level)
+{
+#ifdef CO2_POWER_GATING
+  if (g_sensorPower.state != SENSOR_ON) return;     // only a window now and then
+#endif
+  g_minuteSum += co2Level;
+  if (++g_minuteCount < MINUTE_SAMPLES) return;
+
+  unsigned int minuteLevel = g_minuteSum / g_minuteCount;
+  g_minuteSum   = 0;
+  g_minuteCount = 0;
+  updateForecast(minuteLevel);
+  updateVentilation(minuteLevel);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    forecastBlink
+ * purpose  blinks led 61 while a limit is expected within the warning 
+ *          time, in orange for 1000 ppm and red for 2000 ppm. Runs on the
+ *          expiry of Timer 4 and stops itself when the warning is over.
+ *          Only while the clock is shown: the views and the other modes use
+ *          led 61, and an error code keeps it red until the next redraw.
+ * Inputs   none
+ * Outputs  none
+ * Uses     g_forecast, g_runMode, g_showDisplay, g_displayMode, g_errorShown
+ */
+inline void forecastBlink(void)
+{
+  bool clockShown = g_runMode == RUN && g_showDisplay && g_displayMode == DISPLAY_CLOCK && !g_errorShown;
+  if (g_forecast.minutes == FORECAST_NONE)
+    {
+    if (g_forecast.blinkOn && clockShown)
+      {
+      strip.setPixelColor(RING5, 0);
+      showFrame();
+      }
+    g_forecast.blinkOn = false;
+    return;                                 // Timer 4 is not started again
+    }
+  if (clockShown)
+    {
+    g_forecast.blinkOn = !g_forecast.blinkOn;
+    if (g_forecast.blinkOn) strip.setPixelColor(RING5, (g_forecast.limit == CO2_LIMIT_WARN) ? COLOUR_WARN : COLOUR_RED);
+    else strip.setPixelColor(RING5, 0);
+    showFrame();
+    }
+  startTimer(4);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    recordLatency
+ * purpose  adds the time between request and response of the sensor to
+ *          the latency histogram. Bucket n holds the latencies from 
+ *          2^(n-1) up to 2^n ms, bucket 0 the ones below 1 ms.
+ * Inputs   latency in us
+ * Outputs  none
+ * Updates  g_linkHealth
+ */
+void recordLatency(unsigned long latency)
+{
+  unsigned int latencyMs = latency / 1000;
+  byte bucket = 0;
+  if (latencyMs > g_linkHealth.maxLatency) g_linkHealth.maxLatency = latencyMs;
+  while (latencyMs > 0 && bucket < LATENCY_BUCKETS - 1)
+    {
+    latencyMs >>= 1;
+    bucket++;
+    }
+  g_linkHealth.histogram[bucket]++;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    co2ChecksumOK
+ * purpose  checks a response from the sensor. It must start with 0xFF 0x86 
+ *          and the last byte is the negated sum of bytes 1 to 7.
+ * Inputs   the 9 received bytes
+ * Outputs  true if the response is valid
+ */
+bool co2ChecksumOK(const byte *response)
+{
+  byte checksum = 0;
+  for (byte i = 1; i < 8; i++) checksum += response[i];
+  checksum = 0xFF - checksum + 1;
+  return(response[0] == 0xFF && response[1] == INIT_CO2[2] && response[8] == checksum);
+}
+/***********************************************************************/
+
+
+#ifdef CO2_POWER_GATING
+/*Function *************************************************************
+ * Name:    restartTrends
+ * purpose  forgets the minute averages, the forecast and a running decay 
+ *          episode. Called when the sensor stops reading continuously.
+ * Updates  g_minuteSum, g_minuteCount, g_forecast, g_ventilation
+ */
+void restartTrends(void)
+{
+  g_minuteSum   = 0;
+  g_minuteCount = 0;
+  g_forecast.count       = 0;
+  g_forecast.oldest      = 0;
+  g_forecast.sum         = 0;
+  g_forecast.weightedSum = 0;
+  g_forecast.slopeX16    = 0;
+  g_forecast.limit       = 0;
+  g_forecast.minutes     = FORECAST_NONE;
+  g_ventilation.active   = false;        // no result from half an episode
+  g_ventilation.previous = 0;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    switchSensor
+ * purpose  moves the sensor to a new state and sets its supply
+ * Inputs   the new state, ticks until the next change
+ * Updates  g_sensorPower, OUTPUT_CO2POWER
+ */
+void switchSensor(byte state, unsigned int ticks)
+{
+  SensorPower *power = &g_sensorPower;
+  if (power->state == SENSOR_ON && state != SENSOR_ON) restartTrends();
+  if (state == SENSOR_WARMUP) power->powerUps[TODAY]++;
+  power->state     = state;
+  power->countdown = ticks;
+  digitalWrite(OUTPUT_CO2POWER, state == SENSOR_OFF ? LOW : HIGH);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    sensorPowerTick
+ * purpose  runs the power schedule of the sensor for the ticks of an
+ *          EVT_TICK. Also keeps the off time per day.
+ * Inputs   number of ticks
+ * Outputs  number of these ticks the sensor was off
+ * Uses     g_localTime
+ * Updates  g_sensorPower
+ */
+unsigned int sensorPowerTick(unsigned int ticks)
+{
+  SensorPower *power = &g_sensorPower;
+  if (power->day != g_localTime.day)
+    {
+    // midnight: today becomes yesterday
+    power->day = g_localTime.day;
+    power->offTicks[YESTERDAY] = power->offTicks[TODAY];
+    power->powerUps[YESTERDAY] = power->powerUps[TODAY];
+    power->offTicks[TODAY] = 0;
+    power->powerUps[TODAY] = 0;
+    }
+  bool night = (g_localTime.hour >= GATING_NIGHT_START || g_localTime.hour < GATING_NIGHT_END);
+  unsigned int offTicks = 0;
+  for (; ticks > 0; ticks--)
+    {
+    if (power->sinceReading < GATING_PERIOD_TICKS) power->sinceReading++;
+    if (power->state == SENSOR_OFF) offTicks++;
+    if (power->countdown > 0) power->countdown--;
+
+    switch (power->state)
+      {
+      case SENSOR_ON:
+        if (night) switchSensor(SENSOR_OFF, GATING_OFF_TICKS);
+        break;
+      case SENSOR_OFF:
+        // in the morning, or ahead of the next window
+        if (!night || power->countdown == 0) switchSensor(SENSOR_WARMUP, SENSOR_WARMUP_TICKS);
+        break;
+      case SENSOR_WARMUP:
+        if (power->countdown == 0) 
+          {
+          if (night) switchSensor(SENSOR_SAMPLING, GATING_WINDOW_TICKS);
+          else switchSensor(SENSOR_ON, 0);
+          }
+        break;
+      case SENSOR_SAMPLING:
+        if (!night) switchSensor(SENSOR_ON, 0);
+        else if (power->countdown == 0) switchSensor(SENSOR_OFF, GATING_OFF_TICKS);
+        break;
+      }
+    }
+  power->offTicks[TODAY] += offTicks;
+  return(offTicks);
+}
+/***********************************************************************/
+
+
+#ifdef CO2_PWM_INPUT
+/*Function *************************************************************
+ * Name:    pwmPeriodWarm
+ * purpose  tells if the level of a PWM period was measured during the 
+ *          warm up. A period takes about a second and is delivered at its
+ *          end, so the first period after the warm up started in it: a
+ *          period is warm when the one before it ended in the warm up.
+ * Inputs   none, called for every EVT_CO2
+ * Outputs  true for a warm period
+ * Updates  g_sensorPower
+ */
+bool pwmPeriodWarm(void)
+{
+  bool warmup = (g_sensorPower.state == SENSOR_WARMUP);
+  bool warm   = warmup || g_sensorPower.warmPeriod;
+  g_sensorPower.warmPeriod = warmup;
+  return(warm);
+}
+/***********************************************************************/
+#endif
+#endif
+
+
+#ifdef CO2_POWER_GATING
+/*Function *************************************************************
+ * Name:    readingSamples
+ * purpose  the number of SAMPLE_TIMEs a reading stands for: the time since
+ *          the last reading that was used, rounded, at least one. After a 
+ *          night time off period this is about a whole GATING_PERIOD.
+ * Inputs   none
+ * Outputs  number of samples
+ * Updates  g_sensorPower
+ */
+byte readingSamples(void)
+{
+  unsigned int samples = (g_sensorPower.sinceReading + Timer1Value / 2) / Timer1Value;
+  g_sensorPower.sinceReading = 0;
+  return(samples > 0 ? samples : 1);
+}
+/***********************************************************************/
+#endif
+
+
+/*Function *************************************************************
+ * Name:    newCo2Level
+ * purpose  handles a new valid reading of the sensor: sets the colour of
+ *          the ring, updates the statistics, forecast and ventilation 
+ *          estimate and sends the telemetry record.
+ *          With CO2_POWER_GATING a reading that was taken while the sensor
+ *          was warming up is dropped, and a reading after the sensor was 
+ *          off counts in the statistics for the whole time since the 
+ *          reading before.
+ * Inputs   the CO2 level in ppm
+ * Outputs  none
+ * Uses     g_localTime
+ * Updates  g_co2Level
+ */
+inline void newCo2Level(unsigned int co2Level)
+{
+#ifdef CO2_POWER_GATING
+  if (g_sensorPower.warmReading)
+    {
+    g_sensorPower.discarded++;
+    return;
+    }
+  byte samples = readingSamples();
+#else
+  byte samples = 1;
+#endif
+  g_co2Level = co2Level;
+  setColorLevel(g_co2Level);
+  updateStats(g_co2Level, samples);
+  addMinuteSample(g_co2Level);
+#ifdef SERIAL_TELEMETRY
+  Serial.print(F("M,"));
+  Serial.print(g_co2Level);
+  Serial.print(',');
+  Serial.print(g_localTime.hour);
+  Serial.print(',');
+  Serial.println(g_localTime.minute);
+#endif
+}
+/***********************************************************************/
+
+
+#ifdef CO2_PWM_INPUT
+/*Function *************************************************************
+ * Name: Read CO2 value
+ * purpose  takes the last level measured on the PWM output of the sensor
+ * Inputs 
+ * Outputs 
+ * Uses     g_co2PwmLevel, g_co2PwmReady
+ * This function is called on the expiry of Timer 1. The measurement itself
+ * is done in the input capture interrupt, EVT_CO2 delivers the level.
+ */
+inline void getCO2 ()
+{
+  if(g_timers[1].Over==true)
+    {
+      startTimer(1);                          // Restart the timer
+#ifdef CO2_POWER_GATING
+      if (g_sensorPower.state == SENSOR_OFF) 
+        {
+        g_co2PwmReady = false;                // the input floats while the sensor is off
+        return;
+        }
+#endif
+      g_linkHealth.requests++;
+      cli();
+      g_linkHealth.checksumErrors = g_pwmInvalid;
+      sei();
+      if (g_co2PwmReady)
+        {
+        g_co2PwmReady = false;
+        newCo2Level(g_co2PwmLevel);
+        }
+      else
+        {
+        // no valid period since the last read
+        g_linkHealth.timeouts++;
+        setErrorCode(ERROR_TIMEOUT_CO2);
+        g_co2Level    = 0;
+        }
+    }
+}  
+#else
+/*Function *************************************************************
+ * Name: Read CO2 value
+ * purpose  sends a request to the sensor
+ * Inputs 
+ * Outputs 
+ * Uses
+ * This function is called on the expiry of Timer 1. The response is picked 
+ * up by readCO2Response(), or co2Timeout() runs when Timer 0 expires first.
+ * The time between the request and the response is measured with micros()
+ * (hardware timer 0) and kept in g_linkHealth, together with the number of
+ * time outs, short responses and checksum errors.
+ */
+inline void getCO2 ()
+{
+  if(g_timers[1].Over==true)
+    {
+      startTimer(1);                          // Restart the timer
+#ifdef CO2_POWER_GATING
+      if (g_sensorPower.state == SENSOR_OFF) return;   // no one to answer
+      // the state may change before the response is in
+      g_sensorPower.warmReading = (g_sensorPower.state == SENSOR_WARMUP);
+#endif
+      while (Serial.available() > 0) Serial.read();   // drop what is left of an earlier (late) response
+      Serial.flush();                         // the end of the diagnostics, the request must not wait behind it
+      for (byte i = 0; i < INIT_CO2_LENGTH; i++) Serial.write(INIT_CO2[i]);  // Send the Co2 command from flash
+      g_co2RequestTime = micros();
+      g_co2RequestPending = true;
+      g_linkHealth.requests++;
+      startTimer(0);                          // this is a time out for waiting for a reply      
+    }
+}  
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    readCO2Response
+ * purpose  reads the response of the sensor once all 9 bytes are in
+ * Inputs   none
+ * Outputs  true if a response was handled
+ * Uses     g_co2RequestPending, g_co2RequestTime
+ */
+inline bool readCO2Response(void)
+{
+  byte Co2RxBuf[CO2_BUFFER_SIZE];
+  if (!g_co2RequestPending || Serial.available() < INIT_CO2_LENGTH) return(false);   //the co2 sensor sends back 9 bytes
+
+  // received the string from the CO2 sensor
+  recordLatency(micros() - g_co2RequestTime);
+  Serial.readBytes(Co2RxBuf, INIT_CO2_LENGTH);
+  g_co2RequestPending = false;
+  g_timers[0].Start = false;                          // Stop the timer looking after the time-out
+  if (co2ChecksumOK(Co2RxBuf))
+    {
+    newCo2Level(Co2RxBuf[2]*256 + Co2RxBuf[3]);        // value of the CO2 mesurement in ppm
+    }
+  else
+    {
+    // keep the last value, one bad response is not worth a zero
+    g_linkHealth.checksumErrors++;
+    setErrorCode(ERROR_CHECKSUM_CO2);
+    }
+  return(true);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    co2Timeout
+ * purpose  handles the expiry of Timer 0: the sensor did not respond
+ * Inputs   none
+ * Outputs  none
+ * Uses     g_co2RequestPending
+ */
+inline void co2Timeout(void)
+{
+  if (g_co2RequestPending && g_timers[0].Over)
+    { 
+#ifdef CO2_POWER_GATING
+    if (g_sensorPower.state == SENSOR_OFF)
+      {
+      g_co2RequestPending = false;        // switched off while waiting, not a link error
+      return;
+      }
+#endif
+    // a time out occured  
+    g_co2RequestPending = false;
+    if (Serial.available() > 0) g_linkHealth.shortReads++;   // part of a response came in
+    else g_linkHealth.timeouts++;
+    setErrorCode(ERROR_TIMEOUT_CO2);      // set pixel 61 to red and error message 7
+    g_co2Level    = 0;
+    }
+}
+/***********************************************************************/
+#endif
+/***********************************************************************/
+
+
+
+/*Function *************************************************************
+ * Name:    lookupIrKey
+ * purpose  translates a code with the built-in and the learned keymaps
+ * Inputs   code: protocol, address and command, see irCode()
+ * Outputs  the key, NO_CMD for a code that is in neither keymap or that
+ *          the IR library could not decode
+ * Uses     IR_HASH_TABLE, IR_LEARN_TABLE
+ */
+byte lookupIrKey(uint32_t code)
+{
+  if (irProtocol(code) == UNKNOWN) return(NO_CMD);    // noise, all UNKNOWN frames look alike
+  IrKey irKey = IR_HASH_TABLE[irHash(code, IR_HASH_BITS)];
+  if (irKey.code == code) return(irKey.key);
+
+  byte slot = irHash(code, IR_LEARN_BITS);
+  for (byte probe = 0; probe < IR_LEARN_PROBES; probe++)
+    {
+    eeprom_read_block(&irKey, &IR_LEARN_TABLE[slot], sizeof(IrKey));
+    if (irKey.code == code) return(irKey.key);
+    if (irKey.code == IR_NO_CODE) break;          // the key would have been here
+    slot = (slot + 1) & IR_LEARN_MASK;
+    }
+  return(NO_CMD);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    storeLearnedKey
+ * purpose  puts a key in the first free slot of the learned keymap
+ * Inputs   the key
+ * Outputs  false when the IR_LEARN_PROBES slots from its hash on are taken
+ * Updates  IR_LEARN_TABLE
+ */
+bool storeLearnedKey(const IrKey &irKey)
+{
+  byte slot = irHash(irKey.code, IR_LEARN_BITS);
+  for (byte probe = 0; probe < IR_LEARN_PROBES; probe++)
+    {
+    uint32_t code;
+    eeprom_read_block(&code, &IR_LEARN_TABLE[slot].code, sizeof(code));
+    if (code == IR_NO_CODE)
+      {
+      eeprom_update_block(&irKey, &IR_LEARN_TABLE[slot], sizeof(IrKey));
+      return(true);
+      }
+    slot = (slot + 1) & IR_LEARN_MASK;
+    }
+  return(false);
+}
+/***********************************************************************/
+
 
-      // Set the minute ring (ring 4)
-      for (byte i=0; i< 8; i++)
-        {
-         byte minutesAdd =  2* (g_localTime.minute - (5* minutesMod));
-         // Set the minute blocks in the 8 ring, starting at 52
-         if (minutesAdd > i ) strip.setPixelColor(i+RING4,g_ringColour);
-         else strip.setPixelColor(i+RING4,0)   ; 
-         }  
-      strip.show();   // Update the display
-      }
-     startTimer(2);  // Restart the Timer when done
+/*Function *************************************************************
+ * Name:    forgetLearnedKeys
+ * purpose  erases the learned keymap, only the built-in keys are left.
+ *          Takes about a second when all slots were used.
+ * Updates  IR_LEARN_TABLE
+ */
+void forgetLearnedKeys(void)
+{
+  for (unsigned int i = 0; i < IR_LEARN_SLOTS * sizeof(IrKey); i++)
+    {
+    eeprom_update_byte((byte *) IR_LEARN_TABLE + i, 0xFF);
     }
 }
 /***********************************************************************/
 
 
 /*Function *************************************************************
- * Name:    setColorLevel
- * purpose: converts teh co2level to a color
- * Inputs
- * Outputs
- * Uses
- * 
+ * Name:    showLearn
+ * purpose  shows the progress of learn mode: the outer ring has a led for 
+ *          every learned key. Led 61 is red after an error.
+ * Inputs   error: the key could not be stored
+ * Uses     g_learnCount
  */
-inline void setColorLevel(int actualCo2Level)
-  {
-    byte green, red,blue;
-    if (actualCo2Level <256)
-        {
-          // In this are the colour chnages from blue to green.
-          blue  = 255-actualCo2Level;
-          green = actualCo2Level;
-          red   = 0;
-        }
-    else if(actualCo2Level< 1024 )
-        {
-          // in this range, colour chnages from green to yellow
-          blue  = 0;
-          green = 255;
-          red   = actualCo2Level/4;
-        }
-    else if ( actualCo2Level< 2048)
-        {
-          blue  = 0;
-          green = 128- (actualCo2Level/16) ; 
-          red   = 255;
-          g_showDisplay = true;     // if the CO2 level gets high, override the display of setting.
-        }
-    else 
-       {
-          blue  = 0;
-          green = 0;
-          red   = 255;    // all red
-          g_showDisplay = true;     // if the CO2 level gets high, override the display of setting.
-       }
-    g_ringColour = strip.Color(red, green, blue);   // Set the ring colour based on the CO2 level
-  }
+void showLearn(bool error)
+{
+  strip.clear();
+  for (byte i = 0; i < g_learnCount; i++) strip.setPixelColor(i + RING1, COLOUR_BLUE);
+  if (error) strip.setPixelColor(RING5, COLOUR_RED);
+  showFrame();
+}
 /***********************************************************************/
 
 
 /*Function *************************************************************
- * Name: Read CO2 value
- * purpose  
- * Inputs 
- * Outputs 
- * Uses
- * This function is called in the main loop. 
+ * Name:    endLearn
+ * purpose  returns from learn mode to RUN mode
  */
-inline void getCO2 ()
+void endLearn(void)
 {
-  byte Co2RxBuf[CO2_BUFFER_SIZE];
-  bool co2LevelReceived = false;
-  if(g_timers[1].Over==true)
+  g_runMode = RUN;
+  g_timers[3].Start = false;     // stop the timeout
+  forceTimer(2);                 // redraw the clock
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    learnKey
+ * purpose  stores a code of the new remote as the next key of 
+ *          IR_LEARN_ORDER. After the last key learn mode ends.
+ * Inputs   the code, not in any keymap yet. A code of protocol UNKNOWN
+ *          is not learned.
+ * Updates  g_learnCount, IR_LEARN_TABLE
+ */
+void learnKey(uint32_t code)
+{
+  if (irProtocol(code) == UNKNOWN) return;
+  startTimer(3);                 // restart the timeout for every key
+  IrKey irKey = {code, IR_LEARN_ORDER[g_learnCount]};
+  if (!storeLearnedKey(irKey))
     {
-      startTimer(1);                          // Restart the timer
-      Serial.write(INIT_CO2, INIT_CO2_LENGTH) ;  // Send the Co2 command
-      startTimer(0);                          // this is a time out for waiting for a reply      
-      while (g_timers[0].Over==false && co2LevelReceived==false)
-        {
-        // As long as the timer is running
-        if (Serial.available() ==9)     //the co2 sensor sends back 9 bytes
-          {
-          // received the string from the CO2 sensor
-          Serial.readBytes(Co2RxBuf, 9);
-          co2LevelReceived=true;
-          g_co2Level = Co2RxBuf[2]*256 + Co2RxBuf[3] ;        // value of the CO2 mesurement in ppm
-          g_timers[0].Start = false;                          // Stop the timer looking after the time-out
-          setColorLevel(g_co2Level);
-          }
-        }
-      if(g_timers[0].Over==true)  
-      { 
-         // a time out occured  
-        setErrorCode(ERROR_TIMEOUT_CO2);      // set pixel 61 to red and error message 7
-        g_co2Level    = 0;
-      }
+    showLearn(true);
+    return;
     }
-}  
+  g_learnCount++;
+  if (g_learnCount == IR_LEARN_ORDER.size()) endLearn();
+  else showLearn(false);
+}
 /***********************************************************************/
 
 
-
 /*Function *************************************************************
  * Name:    receiveIR
  * purpose: receive a command from the IR inetrface
+ *          The code is translated with lookupIrKey(), codes of unknown 
+ *          remotes are dropped here. In learn mode they are learned.
  * Inputs
  * Outputs: returns teh transaletd values of the pressed key
  * Uses
@@ -323,41 +1689,25 @@ inline void getCO2 ()
 /***********************************************************************/
 inline byte receiveIR()
   {
-   byte receivedIR;
    byte returnCmd= NO_CMD;         // default to no command, in case no IR signal is received.
    if (IrReceiver.decode())
       {
-         receivedIR=IrReceiver.decodedIRData.command; 
+         PROFILE_START();
+         uint32_t code = irCode(IrReceiver.decodedIRData.protocol, IrReceiver.decodedIRData.address, 
+                                IrReceiver.decodedIRData.command);
+         byte receivedKey = lookupIrKey(code);
           if (!(IrReceiver.decodedIRData.flags & (IRDATA_FLAGS_IS_AUTO_REPEAT | IRDATA_FLAGS_IS_REPEAT))) 
             {
               // This happens only if a key is NOT repeated
               g_countOK=0;
-              switch(receivedIR)
-                {
-                 case 0x45: returnCmd  = 1;         break;
-                 case 0x46: returnCmd  = 2;         break;
-                 case 0x47: returnCmd  = 3;         break;
-                 case 0x44: returnCmd  = 4;         break;
-                 case 0x40: returnCmd  = 5;         break;
-                 case 0x43: returnCmd  = 6;         break;
-                 case 0x7:  returnCmd  = 7;         break;
-                 case 0x15: returnCmd  = 8;         break;
-                 case 0x9:  returnCmd  = 9;         break;
-                 case 0x16: returnCmd  = KEY_AST;   break;
-                 case 0x19: returnCmd  = 0;         break;
-                 case 0x0D: returnCmd  = KEY_HASH;  break;
-                 case 0x18: returnCmd  = KEY_UP;    break;
-                 case 0x8:  returnCmd  = KEY_LEFT;  break;
-                 case 0x1C: returnCmd  = KEY_OK;    break;
-                 case 0x5A: returnCmd  = KEY_RIGHT; break;
-                 case 0x52: returnCmd  = KEY_DOWN;  break;
-               }
+              if (receivedKey == NO_CMD && g_runMode == LEARN) learnKey(code);
+              returnCmd = receivedKey;
             }
           else
             {
             // You get here when a key is repeated
             // We process this only as long as we are in RUN mode
-            if(g_runMode==RUN && receivedIR== 0x1C) //command decoder has not run yet, so need the hexcode.
+            if(g_runMode==RUN && receivedKey == KEY_OK)
               {
                returnCmd=NO_CMD;
                g_countOK++;
@@ -368,12 +1718,13 @@ inline byte receiveIR()
                   g_runMode=CMD;
                   strip.clear();
                   strip.setPixelColor(RING5,COLOUR_ORANGE);  
-                  strip.show();
+                  showFrame();
                   g_digitCount=0; // reset the digit count
                 }
              }
            }
       IrReceiver.resume();
+      PROFILE_END(PROFILE_RECEIVE_IR);
       }
   return(returnCmd);
   }
@@ -403,13 +1754,245 @@ void showEntry(byte entryCode, byte position)
       for (byte i = 0; i< entryCode; i++){strip.setPixelColor(i+RING3,COLOUR_ORANGE); } 
       for (byte i = 0; i<position;   i++){strip.setPixelColor(i+RING2,COLOUR_ORANGE); }
     }
-   strip.show();
+   showFrame();
   }
 
 /***********************************************************************/
 
 
 
+/*Function *************************************************************
+ * Name:    addCharge
+ * purpose  adds a charge to an account, the whole mAs are carried over
+ * Inputs   the account and the charge in mA*ms
+ * Outputs  none
+ */
+void addCharge(Charge *charge, unsigned long mAms)
+{
+  mAms += charge->mAms;
+  charge->mAs  += mAms / 1000;
+  charge->mAms  = mAms % 1000;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    energyMode
+ * purpose  tells which account the clock is using now
+ * Inputs   none
+ * Outputs  ENERGY_OFF, ENERGY_CLOCK, ENERGY_VIEW or ENERGY_CMD (also learn mode)
+ * Uses     g_runMode, g_showDisplay, g_displayMode
+ */
+byte energyMode(void)
+{
+  if (g_runMode != RUN) return(ENERGY_CMD);
+  if (!g_showDisplay) return(ENERGY_OFF);
+  if (g_displayMode == DISPLAY_VIEW) return(ENERGY_VIEW);
+  return(ENERGY_CLOCK);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    accountEnergy
+ * purpose  adds the charge of the ticks of an EVT_TICK to the account of
+ *          the current mode. The sleep time since the last EVT_TICK is 
+ *          spread over the ticks, one at a time.
+ * Inputs   number of ticks, number of these the sensor was off
+ * Outputs  none
+ * Uses     g_ledCurrent
+ * Updates  g_energy
+ */
+void accountEnergy(unsigned int ticks, unsigned int sensorOffTicks)
+{
+  const unsigned long TICK_US = TICK * 1000UL;
+  EnergyAccount *account = &g_energy.account[energyMode()];
+
+  unsigned long sleptUs = g_energy.sleptUs;
+  g_energy.sleptUs = 0;
+  account->ticks += ticks;
+  account->i2cTransactions += g_energy.i2cPending;
+  addCharge(&account->charge[ENERGY_I2C], (unsigned long) g_energy.i2cPending * I2C_TRANSACTION_MAMS);
+  g_energy.i2cPending = 0;
+
+  for (unsigned int i = 0; i < ticks; i++)
+    {
+    unsigned long tickSleptUs = (sleptUs > TICK_US) ? TICK_US : sleptUs;   // a late tick
+    unsigned long awakeUs = TICK_US - tickSleptUs;
+    sleptUs -= tickSleptUs;
+    account->awakeMs += awakeUs / 1000;
+    addCharge(&account->charge[ENERGY_MCU], (awakeUs * MCU_ACTIVE_MA + tickSleptUs * MCU_IDLE_MA) / 1000);
+    addCharge(&account->charge[ENERGY_LED], (unsigned long) g_ledCurrent.last * TICK);
+    if (i >= sensorOffTicks) addCharge(&account->charge[ENERGY_SENSOR], (unsigned long) SENSOR_MA * TICK);
+    }
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    printDiagnostics();
+ * purpose: prints the diagnostic counters on the serial port, one record
+ *          per line, fields separated by commas:
+ *   R,<power on>,<external>,<brown-out>,<watchdog>    restarts per cause
+ *   L,<requests>,<time outs>,<short reads>,<checksum errors>,<max latency ms>
+ *   H,<bucket 0>,...,<bucket 11>                      sensor latency histogram
+ *   E,<lost events>,<peak queue depth>                event queue
+ *   F,<slope ppm/hour>,<limit ppm>,<minutes to limit> forecast, limit 0 if none in sight
+ *   V,<ACH x100>,<last episode ACH x100>,<episodes>,<minutes in current episode>
+ *   C,<last mA>,<peak mA>,<mean mA>,<limited frames>  estimated LED current
+ *   D,<deferred frames>,<forced frames>,<protected IR frames>,<max tick delay us>
+ *   Q,<mode>,<seconds>,<awake ms>,<I2C transactions>,<MCU mAs>,<LED mAs>,<sensor mAs>,<I2C mAs>
+ *                                                     energy account, one line per mode
+ *   G,<state>,<off s today>,<saved mAs today>,<power ups today>,<off s yesterday>,
+ *     <saved mAs yesterday>,<power ups yesterday>,<dropped readings>
+ *                                                     sensor power gating, with CO2_POWER_GATING
+ *   and the kernel profile when built with PROFILE_KERNELS
+ * Inputs
+ * Outputs
+ * Uses     g_warmState, g_linkHealth, g_eventOverflows, g_eventPeak, g_forecast, 
+ *          g_ventilation, g_ledCurrent, g_frameSync, g_energy
+ */
+void printDiagnostics(void)
+{
+  Serial.print(F("R"));
+  for (byte i = 0; i < NUMBER_OF_RESET_CAUSES; i++)
+    {
+    Serial.print(',');
+    Serial.print(g_warmState.resetCount[i]);
+    }
+  Serial.println();
+
+  Serial.print(F("L,"));
+  Serial.print(g_linkHealth.requests);
+  Serial.print(',');
+  Serial.print(g_linkHealth.timeouts);
+  Serial.print(',');
+  Serial.print(g_linkHealth.shortReads);
+  Serial.print(',');
+  Serial.print(g_linkHealth.checksumErrors);
+  Serial.print(',');
+  Serial.println(g_linkHealth.maxLatency);
+
+  Serial.print(F("H"));
+  for (byte i = 0; i < LATENCY_BUCKETS; i++)
+    {
+    Serial.print(',');
+    Serial.print(g_linkHealth.histogram[i]);
+    }
+  Serial.println();
+
+  cli();
+  unsigned int overflows = g_eventOverflows;
+  sei();
+  Serial.print(F("E,"));
+  Serial.print(overflows);
+  Serial.print(',');
+  Serial.println(g_eventPeak);
+
+  Serial.print(F("F,"));
+  Serial.print(((long) g_forecast.slopeX16 * 60) / 16);
+  Serial.print(',');
+  Serial.print(g_forecast.limit);
+  Serial.print(',');
+  Serial.println(g_forecast.minutes);
+
+  Serial.print(F("V,"));
+  Serial.print(g_ventilation.achX100);
+  Serial.print(',');
+  Serial.print(g_ventilation.lastAchX100);
+  Serial.print(',');
+  Serial.print(g_ventilation.episodes);
+  Serial.print(',');
+  Serial.println(g_ventilation.active ? g_ventilation.points : 0);
+
+  Serial.print(F("C,"));
+  Serial.print(g_ledCurrent.last);
+  Serial.print(',');
+  Serial.print(g_ledCurrent.peak);
+  Serial.print(',');
+  Serial.print(g_ledCurrent.meanX16 >> 4);
+  Serial.print(',');
+  Serial.println(g_ledCurrent.limitedFrames);
+
+  cli();
+  unsigned int protectedIrFrames = g_frameSync.protectedIrFrames;
+  unsigned int maxTickLate       = g_frameSync.maxTickLate;
+  sei();
+  Serial.print(F("D,"));
+  Serial.print(g_frameSync.deferredFrames);
+  Serial.print(',');
+  Serial.print(g_frameSync.forcedFrames);
+  Serial.print(',');
+  Serial.print(protectedIrFrames);
+  Serial.print(',');
+  Serial.println((unsigned long) maxTickLate * T1_COUNT_US);
+
+  for (byte mode = 0; mode < NUMBER_OF_ENERGY_MODES; mode++)
+    {
+    const EnergyAccount *account = &g_energy.account[mode];
+    Serial.print(F("Q,"));
+    Serial.print(mode);
+    Serial.print(',');
+    Serial.print((account->ticks * TICK) / 1000);
+    Serial.print(',');
+    Serial.print(account->awakeMs);
+    Serial.print(',');
+    Serial.print(account->i2cTransactions);
+    for (byte part = 0; part < NUMBER_OF_ENERGY_PARTS; part++)
+      {
+      Serial.print(',');
+      Serial.print(account->charge[part].mAs);
+      }
+    Serial.println();
+    }
+
+#ifdef CO2_POWER_GATING
+  Serial.print(F("G,"));
+  Serial.print(g_sensorPower.state);
+  for (byte day = TODAY; day <= YESTERDAY; day++)
+    {
+    unsigned long offSeconds = (g_sensorPower.offTicks[day] * TICK) / 1000;
+    Serial.print(',');
+    Serial.print(offSeconds);
+    Serial.print(',');
+    Serial.print(offSeconds * SENSOR_MA);
+    Serial.print(',');
+    Serial.print(g_sensorPower.powerUps[day]);
+    }
+  Serial.print(',');
+  Serial.println(g_sensorPower.discarded);
+#endif
+
+#ifdef PROFILE_KERNELS
+  printProfile();
+#endif
+}
+/***********************************************************************/
+
+
+#ifndef CO2_PWM_INPUT
+/*Function *************************************************************
+ * Name:    printWantedDiagnostics
+ * purpose: prints the diagnostics that KEY_DOWN asked for during a request
+ *          to the sensor. In the serial mode the text goes out on the link
+ *          of the sensor and takes hundreds of ms at 9600 baud, printed
+ *          during a request it would end up in the latency it reports.
+ * Inputs   none
+ * Outputs  true when the diagnostics were printed
+ * Uses     g_co2RequestPending
+ * Updates  g_diagnosticsWanted
+ */
+bool printWantedDiagnostics(void)
+{
+  if (!g_diagnosticsWanted || g_co2RequestPending) return(false);
+  g_diagnosticsWanted = false;
+  printDiagnostics();
+  return(true);
+}
+/***********************************************************************/
+#endif
+
+
 /*Function *************************************************************
  * Name:    runTimeCommandProcessing();
  * purpose: shows the entered digit on the display.
@@ -421,25 +2004,19 @@ void showEntry(byte entryCode, byte position)
  */
 inline void runTimeCommandProcessing(byte rxcmd)
 {
-byte digits;
-byte displayDigit;
-byte offset;
-int  co2Display;           // these four are used to dispaly the CO2 level on the IR remote control key
-
  switch(rxcmd)
           {
           case KEY_AST: { 
                         /* The "*" switches the display off */
                         g_showDisplay= false;
                         strip.clear();
-                        strip.show();     // otherwise nothng happens, not even clear.
+                        showFrame();     // otherwise nothng happens, not even clear.
                         break;
                         }
           case KEY_HASH: {
                         /* the "#" switches teh display on  */
                         g_showDisplay= true; 
-                        g_timers[2].Start=false;
-                        g_timers[2].Over=true;    // force an updat eof the clock display. 
+                        forceTimer(2);    // force an updat eof the clock display. 
                         break;
                         }
           case KEY_UP:   {
@@ -447,6 +2024,7 @@ int  co2Display;           // these four are used to dispaly the CO2 level on th
                         //Ring 2: Month This will clear when the display is updated again. To make sure you have a reasonable
                         // time, the timer is started again. (Timer 2)
                         startTimer(2);
+                        g_displayMode = DISPLAY_VIEW;
                         strip.clear();
                         for (byte i=0; i<31 ; i++)
                           {   
@@ -458,31 +2036,45 @@ int  co2Display;           // these four are used to dispaly the CO2 level on th
                           if (i<g_localTime.month) strip.setPixelColor(i+RING3,g_ringColour);  
                           else strip.setPixelColor(i+RING3,0);
                          } 
-                        strip.show();
+                        showFrame();
                         break;
                         }  
           case KEY_LEFT: {
                          // Display the real CO2 level on the rings. Ring 4 is MSD!
                          startTimer(2);
-                         strip.clear();
-                         digits =4;
-                         co2Display = g_co2Level;
-                         while (co2Display>0)
-                          {
-                           displayDigit=co2Display%10 + 1; 
-                           co2Display = co2Display/10;
-                           switch(digits)
+                         g_displayMode = DISPLAY_VIEW;
+                         showNumber(g_co2Level);
+                         showFrame();
+                         break;
+                        }                   
+          case KEY_DOWN: {
+                         // Print the diagnostics on the serial port
+#ifndef CO2_PWM_INPUT
+                         if (g_co2RequestPending)
                            {
-                             case 4:  offset = 52; break;
-                             case 3:  offset = 40; break;
-                             case 2:  offset = 24; break;
-                             case 1:  offset =  0; break;
-                             case 0:  offset =  0; break;
+                           g_diagnosticsWanted = true;   // after the response, see printWantedDiagnostics()
+                           break;
                            }
-                           for( byte i=0; i< displayDigit; i++){strip.setPixelColor(i+ offset, g_ringColour);}
-                           digits--;
-                          }
-                         strip.show();
+#endif
+                         printDiagnostics();
+                         break;
+                        }
+          case KEY_ACH: {
+                         // Display the ventilation rate in tenths of air changes per hour
+                         startTimer(2);
+                         g_displayMode = DISPLAY_VIEW;
+                         showNumber(g_ventilation.achX100 / 10);
+                         showFrame();
+                         break;
+                        }                   
+          case KEY_RIGHT: {
+                         // Display the next CO2 statistics figure 
+                         startTimer(2);
+                         g_displayMode = DISPLAY_VIEW;
+                         showStatsFigure(g_statsFigure);
+                         g_statsFigure++;
+                         if (g_statsFigure >= NUMBER_OF_STATS * STATS_FIGURES) g_statsFigure = 0;
+                         showFrame();
                          break;
                         }                   
           }// End switch
@@ -497,13 +2089,27 @@ int  co2Display;           // these four are used to dispaly the CO2 level on th
  * Clear the display
  * Stop the clock update timer for the time being
  * Start a time out
+ * "#" starts learn mode, "*" asks to forget the learned remotes, which the 
+ * next key confirms ("*" or OK) or cancels.
  * Inputs
  * Outputs
- * Uses
+ * Uses     g_forgetArmed
  */
    
 inline void  cmdTimeCommandProcessing(byte rxcmd)
 {
+  if (g_forgetArmed)
+        {
+         // The key after "*": a second "*" or OK forgets all learned remotes,
+         // any other key keeps them. Both end command mode.
+         g_forgetArmed = false;
+         if (rxcmd == KEY_AST || rxcmd == KEY_OK) forgetLearnedKeys();
+         g_runMode= RUN;
+         g_timers[3].Start = false;     // stop the timeout
+         forceTimer(2);                 // redraw the clock
+         return;
+        }
+
   if(rxcmd < KEY_UP)
         {
         // Handle the timesetting sequence
@@ -596,45 +2202,75 @@ inline void  cmdTimeCommandProcessing(byte rxcmd)
               //int newTime = 100 * newHour+ newMinute;
               //Serial.print(newDay,DEC); Serial.print("-");Serial.print(newMonth,DEC);Serial.print("-");Serial.println(newYear,DEC);
               //Serial.println(newTime,DEC);
-              // Update the RTC with the new value
-              g_rtc.adjust(DateTime(g_newYear, g_newMonth, g_newDay, g_newHour, g_newMinute, 0));
+              // Update the RTC with the new value, the RTC runs on UTC
+              g_rtc.adjust(localToUtc(DateTime(g_newYear, g_newMonth, g_newDay, g_newHour, g_newMinute, 0)));
+              g_energy.i2cPending++;
             }
            /* Also if you did not receive all keys, return to normal mode again */
            g_runMode= RUN;
            g_timers[3].Start = false;     // stop the timeout
-           g_timers[2].Start = false;     // stop the clock update
-           g_timers[2].Over  = true;      // set teh timeput to provoke an update now.
+           forceTimer(2);                 // set teh timeput to provoke an update now.
          } // End Commnd OK
+
+  if(rxcmd == KEY_HASH)
+        {
+         // Learn the keys of another remote
+         startTimer(3);
+         g_timers[2].Start = false;     // stop the clock update timer
+         g_runMode = LEARN;
+         g_learnCount = 0;
+         showLearn(false);
+        }
+
+  if(rxcmd == KEY_AST)
+        {
+         // Forget all learned remotes, after a confirmation. The outer ring 
+         // is red until then.
+         startTimer(3);
+         g_timers[2].Start = false;     // stop the clock update timer
+         g_forgetArmed = true;
+         strip.clear();
+         for (byte i = 0; i < RING2; i++) strip.setPixelColor(i + RING1, COLOUR_RED);
+         showFrame();
+        }
       }
 /***********************************************************************/
 
 
 /*Function *************************************************************
- * Name:    IRcommandHandler();
- * purpose: 
+ * Name:    commandTimeout();
+ * purpose: handles the expiry of Timer 3, the command time out.
+ *          return to RUN mode , clear the display and show the display again.
  * Inputs
  * Outputs
- * Uses
- * The command is :
- * 
- *
+ * Uses     g_timers[3]
  ***********************************************************************/
-
-inline void IRcommandHandler()
+inline void commandTimeout()
 {
   if (g_timers[3].Over)
      {
-       /* This is a command timeout
-        * return to RUN mode , clear the display and show the display again.
-        */
        strip.clear();
        g_showDisplay=true;
        g_runMode=RUN;
+       g_forgetArmed=false;       // no confirmation, keep the learned keys
        g_timers[3].Over=false;    // Reset the time out flag
        startTimer(2);           // Restart the clock update timer;
      }
-  else
-    {
+}
+
+/*Function *************************************************************
+ * Name:    IRcommandHandler();
+ * purpose: handles a frame of the IR receiver (EVT_IR)
+ * Inputs
+ * Outputs
+ * Uses
+ * The command is :
+ * 
+ *
+ ***********************************************************************/
+
+inline void IRcommandHandler()
+{
     g_command=receiveIR();
     //There is a set of keys processed in RUN mode
     if (g_command != NO_CMD)
@@ -649,6 +2285,164 @@ inline void IRcommandHandler()
           cmdTimeCommandProcessing(g_command);
           g_command= NO_CMD;   // Reset the command after processing
         }
+       if (g_runMode==LEARN && g_command==KEY_OK) 
+        {
+          endLearn();          // OK of a known remote, keep what was learned
+          g_command= NO_CMD;
+        }
+      }
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    dispatchEvent();
+ * purpose: runs the handler of an event from the queue
+ * Inputs   the event
+ * Outputs
+ ***********************************************************************/
+inline void dispatchEvent(const Event &event)
+{
+  switch (event.type)
+    {
+    case EVT_TIMER:
+      switch (event.data)
+        {
+#ifndef CO2_PWM_INPUT
+        case 0: co2Timeout();     break;   // no response from the sensor
+#endif
+        case 1: getCO2();         break;   // time for a new CO2 reading
+        case 2: updateClock();    break;   // time to update the clock
+        case 3: commandTimeout(); break;   // command mode time out
+        case 4: forecastBlink();  break;   // blink the forecast warning
+        }
+      break;
+    case EVT_DOOR:
+      checkDoor();          // That will stop all functions while the door is open.
+      break;
+    case EVT_IR:
+      IRcommandHandler();
+      break;
+    case EVT_TICK:
+      {
+      unsigned int ticks = takePendingTicks();
+      unsigned int sensorOffTicks = 0;
+#ifdef CO2_POWER_GATING
+      sensorOffTicks = sensorPowerTick(ticks);
+#endif
+      accountEnergy(ticks, sensorOffTicks);
       }
+      break;
+#ifdef CO2_PWM_INPUT
+    case EVT_CO2:
+      g_co2PwmLevel = event.data;      // picked up on the next read (Timer 1)
+      g_co2PwmReady = true;
+#ifdef CO2_POWER_GATING
+      g_sensorPower.warmReading = pwmPeriodWarm();
+#endif
+      break;
+#endif
+    }
+}
+/***********************************************************************/
+
+/*Function *************************************************************
+ * Name:    saveResetCause
+ * purpose: copies the reset flags before anything else runs and stops the
+ *          watchdog. After a watchdog reset the watchdog stays enabled, so
+ *          it must be switched off before the (long) setup() starts.
+ *          This runs in .init3, before the RAM is initialised, which is why
+ *          g_mcusrCopy lives in .noinit.
+ * Inputs   none
+ * Outputs  none
+ * Uses     g_mcusrCopy
+ */
+void saveResetCause(void) __attribute__ ((naked, used, section (".init3")));
+void saveResetCause(void)
+{
+  g_mcusrCopy = MCUSR;
+  MCUSR = 0;
+  wdt_disable();
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    warmStateCrc
+ * purpose: calculates the CRC16 over the warm restart snapshot, except
+ *          the crc field itself
+ * Inputs   none
+ * Outputs  the CRC
+ * Uses     g_warmState
+ */
+unsigned int warmStateCrc(void)
+{
+  const byte *data = (const byte *) &g_warmState;
+  unsigned int crc = 0xFFFF;
+  for (byte i = 0; i < sizeof(WarmState) - sizeof(g_warmState.crc); i++)
+    {
+    crc = _crc16_update(crc, data[i]);
+    }
+  return(crc);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    saveWarmState
+ * purpose: copies the display state into the .noinit snapshot. Called at
+ *          the end of every pass of the main loop.
+ * Inputs   none
+ * Outputs  none
+ * Uses     g_co2Level, g_ringColour, g_showDisplay, strip
+ * Updates  g_warmState
+ */
+inline void saveWarmState(void)
+{
+  g_warmState.co2Level    = g_co2Level;
+  g_warmState.ringColour  = g_ringColour;
+  g_warmState.showDisplay = g_showDisplay;
+  g_warmState.brightness  = strip.getBrightness();
+  g_warmState.crc         = warmStateCrc();
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    restoreWarmState
+ * purpose: decodes the reset cause, counts it and restores the display
+ *          state when the board was reset by the watchdog or a brown-out
+ *          and the snapshot is still valid.
+ *          After a power on the .noinit RAM holds garbage, the CRC check
+ *          then fails and the counters start from zero.
+ * Inputs   none
+ * Outputs  true if the state was restored and a warm start can be done
+ * Uses     g_mcusrCopy
+ * Updates  g_resetCause, g_warmState, g_co2Level, g_ringColour, g_showDisplay
+ */
+bool restoreWarmState(void)
+{
+  bool snapshotValid = (warmStateCrc() == g_warmState.crc);
+  bool warmStart     = false;
+
+  if      (g_mcusrCopy & (1 << WDRF))  g_resetCause = RESET_CAUSE_WATCHDOG;
+  else if (g_mcusrCopy & (1 << BORF))  g_resetCause = RESET_CAUSE_BROWN_OUT;
+  else if (g_mcusrCopy & (1 << EXTRF)) g_resetCause = RESET_CAUSE_EXTERNAL;
+  else                                 g_resetCause = RESET_CAUSE_POWER_ON;
+
+  if (!snapshotValid)
+    {
+    memset(&g_warmState, 0, sizeof(WarmState));
     }
-}
\ No newline at end of file
+  else if (g_resetCause == RESET_CAUSE_WATCHDOG || g_resetCause == RESET_CAUSE_BROWN_OUT)
+    {
+    g_co2Level    = g_warmState.co2Level;
+    g_ringColour  = g_warmState.ringColour;
+    g_showDisplay = g_warmState.showDisplay;
+    warmStart     = true;
+    }
+  g_warmState.resetCount[g_resetCause]++;
+  g_warmState.crc = warmStateCrc();
+  return(warmStart);
+}
+/***********************************************************************/
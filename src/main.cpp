@@ -49,14 +49,28 @@
  */
 void setup() 
 {
+  // After a watchdog or brown-out reset the last state is restored from the 
+  // .noinit snapshot and the start up sequence is skipped. 
+  g_showDisplay = true;           // Display is on.
+  g_ringColour = COLOUR_BLUE;     // Set initial colour to blue;
+  bool warmStart = restoreWarmState();
+#ifdef PROFILE_KERNELS
+  paintStack();
+#endif
+
   // Hardware inits
   pinMode(INPUT_DOOR, INPUT_PULLUP);
   pinMode(OUTPUT_CO2INIT , OUTPUT);
+#ifdef CO2_POWER_GATING
+  // The sensor was off during the reset, it starts with a warm up
+  pinMode(OUTPUT_CO2POWER, OUTPUT);
+  switchSensor(SENSOR_WARMUP, SENSOR_WARMUP_TICKS);
+#endif
   //All other pins are set by their libraries.
 
-  //Set the init output for the CO2 module to low
-  digitalWrite(OUTPUT_CO2INIT , LOW);
-  g_showDisplay = true;           // Display is on.
+  //Set the init output for the CO2 module to low. On a warm start the sensor 
+  //is already running, so it is enabled straight away.
+  digitalWrite(OUTPUT_CO2INIT , warmStart ? HIGH : LOW);
   Serial.begin(9600);
 
   g_rtc.begin();      // start the rtc
@@ -65,7 +79,8 @@ void setup()
     {
     // When time needs to be re-set on a previously configured device, the
     // following line sets the RTC to the date & time this sketch was compiled
-     g_rtc.adjust(DateTime( F(__DATE__), F(__TIME__) ));
+     // The compiler gives the local time, the RTC runs on UTC.
+     g_rtc.adjust(localToUtc(DateTime( F(__DATE__), F(__TIME__) )));
      //Comment: I am not entirely convinced this works reliable. 
     }
 
@@ -74,44 +89,61 @@ void setup()
   g_timers[1].InitialValue = Timer1Value;
   g_timers[2].InitialValue = Timer2Value;
   g_timers[3].InitialValue = Timer3Value;
+  g_timers[4].InitialValue = Timer4Value;
+  g_forecast.minutes = FORECAST_NONE;
   
+#ifdef CO2_PWM_INPUT
+  // CTC mode for the tick, input capture for the PWM output of the sensor
+  pinMode(INPUT_CO2PWM, INPUT);
+  TCNT1  = 0;
+  OCR1A  = T1_TOP;
+	TCCR1A = 0x00;
+	TCCR1B = TCCR1B_PWM;
+  TIFR1  = (1 << ICF1) | (1 << OCF1A);
+	TIMSK1 = (1 << OCIE1A) | (1 << ICIE1);
+#else
   TCNT1 = T1_COUNT;           // for for interrupt of Tick ms.
 	TCCR1A = 0x00;
 	TCCR1B = TCCR1B_INIT;       // Timer mode 
 	TIMSK1 = (1 << TOIE1) ;    // Enable timer1 overflow interrupt(TOIE1)
+#endif
 
   // Initialise the strip 
   strip.begin();
-  strip.setBrightness(10);     // Set to low brightness during start up
-  strip.show();                // Initialize all pixels to 'off'
-  g_ringColour = COLOUR_BLUE;  // Set initial colour to blue;
+  if (warmStart) strip.setBrightness(g_warmState.brightness);
+  else strip.setBrightness(10);     // Set to low brightness during start up
+  showFrame();                // Initialize all pixels to 'off'
 
   // Set the IR receiver
   IrReceiver.begin(IR_RECEIVE_PIN, ENABLE_LED_FEEDBACK);
+  IrReceiver.registerReceiveCompleteCallback(irFrameReceived);   // posts EVT_IR
   g_command=NO_CMD;
 
-  // Startup the CO2 sensor, It needs 7 seconds of 'low'at the input
-  digitalWrite(OUTPUT_CO2INIT , LOW); 
-
-  //Fill the dots one after the other with blue during startup This sequence takes 6.1 seconds
-  for(byte i=0; i < 61 ; i++) 
-    {
-    strip.setPixelColor(i, g_ringColour);
-    strip.show();
-    delay(100);
-    }
-  
-  // Clear the dots, which will take another 6.1 seconds.
-  for(byte i=0; i < 61 ; i++) 
+  if (!warmStart)
     {
-    strip.setPixelColor(i, 0);
-    strip.show();
-    delay(100);
+    // Startup the CO2 sensor, It needs 7 seconds of 'low'at the input
+    digitalWrite(OUTPUT_CO2INIT , LOW); 
+
+    //Fill the dots one after the other with blue during startup This sequence takes 6.1 seconds
+    for(byte i=0; i < 61 ; i++) 
+      {
+      strip.setPixelColor(i, g_ringColour);
+      showFrame();
+      delay(100);
+      }
+    
+    // Clear the dots, which will take another 6.1 seconds.
+    for(byte i=0; i < 61 ; i++) 
+      {
+      strip.setPixelColor(i, 0);
+      showFrame();
+      delay(100);
+      }
+
+    // Clear the init output again, this will now enable the CO2 sensor
+    digitalWrite(OUTPUT_CO2INIT , HIGH);
     }
 
-  // Clear the init output again, this will now enable the CO2 sensor
-  digitalWrite(OUTPUT_CO2INIT , HIGH);
-
   // force an update of the clock display
   g_timers[2].Over=true;
   updateClock();
@@ -121,8 +153,14 @@ void setup()
   startTimer(1);    
   startTimer(2); 
 
+  // The door posts an event on every change, check it once now for a door that is already open
+  attachInterrupt(digitalPinToInterrupt(INPUT_DOOR), doorChanged, CHANGE);
+  postEventFromLoop(EVT_DOOR, 0);
+  set_sleep_mode(SLEEP_MODE_IDLE);
+
 	sei();         // enable interrupts
   g_runMode=RUN;   // Run mode
+  wdt_enable(WATCHDOG_TIMEOUT);   // from now on the main loop must feed the watchdog
 }
 
 
@@ -135,31 +173,73 @@ void setup()
 
 void loop() 
 {
-  updateClock();        //update the internal clock strcuture every (Timer 2) seconds
-  checkDoor();          // see if the door is open. That will stop all functions and turn the center led red.
-  getCO2();             //Get a new value from the CO2 sensor
-  updateBrightness();   //adapt the brightness of the ring to the ambient light value
-  IRcommandHandler();   // IR Commandhandler
+  Event event;
+  bool  busy = false;
+
+  wdt_reset();          // feed the watchdog, if the loop hangs the board restarts warm
+  while (getEvent(&event))
+    {
+    // timers: clock update, CO2 reading, time outs. door, IR key
+    dispatchEvent(event);
+    busy = true;
+    }
+#ifndef CO2_PWM_INPUT
+  if (readCO2Response()) busy = true;  //Get a new value from the CO2 sensor
+  if (printWantedDiagnostics()) busy = true;   // KEY_DOWN during a request
+#endif
+  if (flushFrame()) busy = true;       // a frame held back for the IR receiver
+
+  if (busy)
+    {
+    updateBrightness();   //adapt the brightness of the ring to the ambient light value
+    saveWarmState();      // keep the snapshot for a warm restart up to date
+    }
+  else
+    {
+    // Nothing to do, sleep until the next interrupt. Interrupts stay off
+    // between the check and the sleep, so no event can slip in between.
+    cli();
+    if (g_eventHead == g_eventTail)
+      {
+      unsigned long sleepStart = micros();
+      sleep_enable();
+      sei();
+      sleep_cpu();
+      sleep_disable();
+      g_energy.sleptUs += micros() - sleepStart;   // for the energy account
+      }
+    sei();
+    }
 }
 
 /*************************************************************************************** 
  * Timer Interrupt                                                                     *
  *                                                                                     *
  ***************************************************************************************/ 
+#ifdef CO2_PWM_INPUT
+ISR (TIMER1_COMPA_vect)
+{
+    // Timer interrupt, the counter restarts by itself in CTC mode
+    PROFILE_START();
+    g_tickCount++;
+    timerTick();
+    PROFILE_END(PROFILE_TIMER_ISR);
+}
+
+ISR (TIMER1_CAPT_vect)
+{
+    // Edge on the PWM output of the CO2 sensor
+    pwmCapture();
+}
+#else
 ISR (TIMER1_OVF_vect)
 {
     // Timer interrupt
-    for(byte i=0;i<NUMBER_OF_TIMERS;i++)
-       {
-        if(g_timers[i].Start)
-        {
-         g_timers[i].Count--;
-         if(g_timers[i].Count==0)
-           {
-            g_timers[i].Start=false;
-            g_timers[i].Over=true;
-           }
-         } 
-        }
-     TCNT1 = T1_COUNT;            // reload the timer value
+    PROFILE_START();
+    unsigned int late = TCNT1;    // counts since the overflow, e.g. during strip.show()
+    TCNT1 += T1_COUNT;            // reload the timer value, keeping the counts we were late
+    if (late > g_frameSync.maxTickLate) g_frameSync.maxTickLate = late;
+    timerTick();
+    PROFILE_END(PROFILE_TIMER_ISR);
 }
+#endif
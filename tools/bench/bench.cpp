@@ -0,0 +1,174 @@
+/***********************************************************************
+ * Kernel benchmark for simavr
+ * Runs every kernel with a set of inputs on a simulated ATmega328P and 
+ * counts the cycles with timer 1 at the full clock (prescale 1). The 
+ * libraries are the stand-ins of tools/stubs, so the RTC read and the
+ * transmission to the ring cost nothing: only the code of the kernel 
+ * itself is counted. The stack is measured by painting the RAM below the
+ * stack pointer before the call.
+ * Output on the UART, one line per kernel:
+ *   K,<kernel>,<runs>,<min cycles>,<max cycles>,<stack bytes>
+ * The Makefile adds the flash size of every bench_* function and compares
+ * the result with baseline.txt.
+ ***********************************************************************/
+#include <Arduino.h>
+#include <avr/sleep.h>
+#include "declarations.h"
+#include "functions.h"
+
+const byte STACK_PAINT = 0xA5;
+const unsigned int STACK_WINDOW = 256;  // bytes below the stack pointer that are checked, at most
+
+typedef void (*Kernel)(byte input);
+
+unsigned int g_overhead;                // cycles of an empty measurement
+unsigned int g_stackUsed;
+
+/*Function *************************************************************
+ * Name:    measure
+ * purpose  runs a kernel once, with the interrupts off
+ * Inputs   the kernel and its input
+ * Outputs  cycles, without the cost of the measurement itself
+ * Updates  g_stackUsed, the deepest stack seen
+ */
+extern char  __heap_start;
+extern char *__brkval;
+
+unsigned long measure(Kernel kernel, byte input)
+{
+  // paint below the stack pointer, but stay clear of the heap (the pixels)
+  byte *top  = (byte *) SP;
+  byte *heap = (byte *) (__brkval ? __brkval : &__heap_start);
+  unsigned int window = STACK_WINDOW;
+  if (top - heap - 16 < (int) window) window = top - heap - 16;
+  for (unsigned int i = 1; i <= window; i++) top[-(int) i] = STACK_PAINT;
+
+  cli();
+  TCCR1A = 0;
+  TCCR1B = 0;
+  TCNT1  = 0;
+  TIFR1  = (1 << TOV1);
+  TCCR1B = (1 << CS10);               // count every cycle
+  kernel(input);
+  TCCR1B = 0;
+  unsigned long cycles = TCNT1;
+  if (TIFR1 & (1 << TOV1)) cycles += 65536UL;   // one overflow is enough for these kernels
+  sei();
+
+  unsigned int used = window;
+  while (used > 0 && top[-(int) used] == STACK_PAINT) used--;
+  if (used > g_stackUsed) g_stackUsed = used;
+  return(cycles > g_overhead ? cycles - g_overhead : 0);
+}
+/***********************************************************************/
+
+/* The kernels, noinline so avr-nm gives the size of every one */
+__attribute__((noinline)) void bench_empty(byte) {}
+
+__attribute__((noinline)) void bench_setColorLevel(byte input)
+{
+  setColorLevel(300 + input * 250U);               // 300 .. 2550 ppm, all colours
+}
+
+__attribute__((noinline)) void bench_updateClock(byte input)
+{
+  simRtcTime = 1700000000UL + input * 3917UL;      // spread over hours and minutes
+  g_timers[2].Over = true;
+  updateClock();
+}
+
+__attribute__((noinline)) void bench_receiveIR(byte input)
+{
+  IrKey irKey = IR_HASH_TABLE[input % IR_HASH_SLOTS];
+  simIrFrame(NEC, 0x00, irKey.code & 0xFF, 0);
+  receiveIR();
+}
+
+__attribute__((noinline)) void bench_timerTick(byte input)
+{
+  g_eventHead = g_eventTail;                       // keep the queue from filling
+  g_eventsWaiting = 0;                             // post the tick every time
+  timerTick();
+}
+
+__attribute__((noinline)) void bench_transmitFrame(byte input)
+{
+  for (byte i = 0; i < strip.numPixels(); i++) strip.setPixelColor(i, (uint32_t) input * 0x010101UL);
+  transmitFrame(true);
+}
+
+__attribute__((noinline)) void bench_updateForecast(byte input)
+{
+  updateForecast(600 + input * 7U);
+}
+
+__attribute__((noinline)) void bench_updateVentilation(byte input)
+{
+  updateVentilation(2000 - input * 5U);
+}
+
+__attribute__((noinline)) void bench_lookupIrKey(byte input)
+{
+  lookupIrKey(irCode(SONY, input, input));         // a miss, through the EEPROM table
+}
+
+typedef struct
+    {
+    const char *name;
+    Kernel      kernel;
+    } Bench;
+
+const Bench BENCHES[] = {
+    {"setColorLevel",     bench_setColorLevel},
+    {"updateClock",       bench_updateClock},
+    {"receiveIR",         bench_receiveIR},
+    {"timerTick",         bench_timerTick},
+    {"transmitFrame",     bench_transmitFrame},
+    {"updateForecast",    bench_updateForecast},
+    {"updateVentilation", bench_updateVentilation},
+    {"lookupIrKey",       bench_lookupIrKey},
+    };
+const byte BENCH_RUNS = 10;             // inputs 0 .. 9 for every kernel
+
+int main(void)
+{
+  Serial.begin(9600);
+  strip.begin();
+  strip.setBrightness(100);
+  g_runMode = RUN;
+  g_showDisplay = true;
+  g_ringColour = COLOUR_GREEN;
+  for (byte i = 0; i < NUMBER_OF_TIMERS; i++) g_timers[i].InitialValue = 1;
+
+  g_overhead = 0;
+  g_overhead = measure(bench_empty, 0);
+
+  for (byte b = 0; b < sizeof(BENCHES) / sizeof(Bench); b++)
+    {
+    unsigned long minCycles = 0xFFFFFFFF;
+    unsigned long maxCycles = 0;
+    g_stackUsed = 0;
+    for (byte input = 0; input < BENCH_RUNS; input++)
+      {
+      unsigned long cycles = measure(BENCHES[b].kernel, input);
+      if (cycles < minCycles) minCycles = cycles;
+      if (cycles > maxCycles) maxCycles = cycles;
+      }
+    Serial.print(F("K,"));
+    Serial.print(BENCHES[b].name);
+    Serial.print(',');
+    Serial.print((unsigned int) BENCH_RUNS);
+    Serial.print(',');
+    Serial.print(minCycles);
+    Serial.print(',');
+    Serial.print(maxCycles);
+    Serial.print(',');
+    Serial.println(g_stackUsed);
+    }
+
+  // simavr stops on a sleep with the interrupts off
+  while (!(UCSR0A & (1 << TXC0))) ;
+  cli();
+  sleep_enable();
+  sleep_cpu();
+}
@@ -0,0 +1,704 @@
+/***********************************************************************
+* {{ CO2 IKEA CLOCK }}
+* Copyright (C) {{ 2022 }}  {{ The Meerkat Group }}
+*
+* FILENAME :  co2collect.cpp
+*
+* DESCRIPTION :
+*   Telemetry collector for a room full of CO2 clocks. Runs on Linux.
+*   It reads the serial ports of many clocks at the same time from one
+*   thread with epoll, decodes the readings the firmware sends when it is
+*   built with SERIAL_TELEMETRY:
+*     M,<ppm>,<local hour>,<local minute>
+*   and appends them to a column store. Other lines (diagnostics) are
+*   counted and skipped.
+*
+*   Build:   g++ -O2 -std=c++11 -o co2collect co2collect.cpp
+*   Collect: co2collect -o <directory> <device> [<device> ...]
+*   Emulate: co2collect --emulate <count> [--interval <ms>]
+*            opens <count> pseudo terminals that send readings like the
+*            firmware does and prints the names of the slave sides, so the
+*            collector can be run against them without hardware:
+*              co2collect --emulate 200 > ports.txt &
+*              co2collect -o data $(cat ports.txt)
+*
+*   Column store, all files in <directory>, little endian, append only:
+*     time.col       int64   host time of arrival, us since 1970
+*     device.col     uint16  device number
+*     co2.col        uint16  CO2 level in ppm
+*     local.col      uint16  local time of the clock, minutes after midnight
+*     devices.txt    "<device number> <path>" per line
+*     device-<n>.idx uint32  row numbers of the readings of device n
+*   Row r of the store is element r of every column. Device numbers are
+*   kept for a path over restarts, rows are appended after the existing ones.
+*   On a start the columns are cut back to the shortest one, a write that was
+*   interrupted leaves no partial rows, and index entries past it are dropped.
+*   Columns are written in blocks, at least once per second.
+*
+* NOTES :
+*   One open file per device plus one per device index, so for hundreds
+*   of devices raise the open file limit (ulimit -n).
+*
+* AUTHOR :    Petermaria van Herpen        START DATE :    1-JAN-2022
+*
+* LICENSE:
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* CHANGES :
+* REF NO  VERSION DATE    WHO     DETAIL
+*
+*
+*********************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+
+/********************************************************************************/
+/* Constants                                                                    */
+/********************************************************************************/
+const size_t   LINE_LENGTH      = 80;          // longer lines are not from the clock
+const size_t   READ_SIZE        = 4096;
+const size_t   FLUSH_SIZE       = 64 * 1024;   // bytes buffered per column before a write
+const int      FLUSH_INTERVAL   = 1000;        // ms, the longest data stays in memory
+const int      MAX_EVENTS       = 64;
+const unsigned CO2_MAXIMUM      = 10000;       // ppm, above this a reading is invalid
+const int      EMULATE_INTERVAL = 5000;        // ms, the firmware reads every 5 seconds
+
+
+/********************************************************************************/
+/* Types                                                                        */
+/********************************************************************************/
+typedef struct
+{
+  int                  fd;
+  std::vector<uint8_t> buffer;
+} Column;
+
+typedef struct
+{
+  int           fd;
+  uint16_t      number;                  // device number in the store
+  std::string   path;
+  char          line[LINE_LENGTH];
+  size_t        lineLength;
+  bool          lineTooLong;
+  Column        index;                   // row numbers of this device
+  unsigned long readings;
+  unsigned long otherLines;
+  unsigned long badLines;
+} Device;
+
+volatile sig_atomic_t g_stop = 0;
+
+
+/*Function *************************************************************
+ * Name:    onSignal
+ * purpose: stops the main loop on SIGINT and SIGTERM
+ */
+void onSignal(int)
+{
+  g_stop = 1;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    nowMicros
+ * purpose: wall clock time in us since 1970
+ */
+int64_t nowMicros(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    openColumn
+ * purpose: opens a column file for appending
+ * Inputs   directory, file name
+ * Outputs  false if the file cannot be opened
+ */
+bool openColumn(Column &column, const std::string &directory, const std::string &name)
+{
+  std::string path = directory + "/" + name;
+  column.fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (column.fd < 0)
+    {
+    fprintf(stderr, "co2collect: %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+    }
+  column.buffer.reserve(FLUSH_SIZE);
+  return true;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    appendValue
+ * purpose: adds a value in little endian to the buffer of a column
+ */
+template <typename T> void appendValue(Column &column, T value)
+{
+  for (size_t i = 0; i < sizeof(T); i++)
+    {
+    column.buffer.push_back((uint8_t) (value >> (8 * i)));
+    }
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    flushColumn
+ * purpose: writes the buffer of a column to its file
+ * Outputs  false on a write error
+ */
+bool flushColumn(Column &column)
+{
+  size_t done = 0;
+  while (done < column.buffer.size())
+    {
+    ssize_t written = write(column.fd, &column.buffer[done], column.buffer.size() - done);
+    if (written < 0)
+      {
+      if (errno == EINTR) continue;
+      perror("co2collect: write");
+      return false;
+      }
+    done += written;
+    }
+  column.buffer.clear();
+  return true;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    fileSize
+ * purpose: size of a file, 0 if it does not exist
+ */
+off_t fileSize(const std::string &path)
+{
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0) return 0;
+  return info.st_size;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    truncateColumn
+ * purpose: cuts a column back to a number of rows
+ * Inputs   column, number of rows, size of an element
+ * Outputs  false on an error
+ */
+bool truncateColumn(Column &column, uint32_t rows, size_t size)
+{
+  if (ftruncate(column.fd, (off_t) rows * size) != 0)
+    {
+    perror("co2collect: ftruncate");
+    return false;
+    }
+  return true;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    trimIndex
+ * purpose: drops the entries of a device index that point at or past the
+ *          end of the store, and a partial entry. The row numbers in an
+ *          index go up, so these are at the end.
+ * Inputs   path of the index, rows in the store
+ * Outputs  false on an error
+ */
+bool trimIndex(const std::string &path, uint32_t rows)
+{
+  int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0) return errno == ENOENT;
+  off_t entries = fileSize(path) / sizeof(uint32_t);
+  while (entries > 0)
+    {
+    uint8_t entry[sizeof(uint32_t)];
+    if (pread(fd, entry, sizeof(entry), (entries - 1) * sizeof(uint32_t)) != (ssize_t) sizeof(entry)) break;
+    uint32_t row = entry[0] | (entry[1] << 8) | (entry[2] << 16) | ((uint32_t) entry[3] << 24);
+    if (row < rows) break;
+    entries--;
+    }
+  bool ok = ftruncate(fd, entries * sizeof(uint32_t)) == 0;
+  if (!ok) fprintf(stderr, "co2collect: %s: %s\n", path.c_str(), strerror(errno));
+  close(fd);
+  return ok;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    makeRaw
+ * purpose: sets a serial port (or pty) to 9600 baud, raw, no echo
+ */
+void makeRaw(int fd)
+{
+  struct termios settings;
+  if (tcgetattr(fd, &settings) != 0) return;     // not a terminal, fine for a pipe
+  cfmakeraw(&settings);
+  cfsetispeed(&settings, B9600);
+  cfsetospeed(&settings, B9600);
+  settings.c_cflag |= CLOCAL | CREAD;
+  tcsetattr(fd, TCSANOW, &settings);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    loadDeviceNumbers
+ * purpose: reads devices.txt, so a path keeps its device number
+ */
+void loadDeviceNumbers(const std::string &directory, std::map<std::string, uint16_t> &numbers)
+{
+  FILE *file = fopen((directory + "/devices.txt").c_str(), "r");
+  if (file == NULL) return;
+  unsigned number;
+  char path[4096];
+  while (fscanf(file, "%u %4095s", &number, path) == 2)
+    {
+    numbers[path] = (uint16_t) number;
+    }
+  fclose(file);
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    Collector
+ * purpose: the column store and the devices that feed it
+ ***********************************************************************/
+class Collector
+{
+public:
+  bool open(const std::string &directory);
+  bool addDevice(const std::string &path);
+  int  run(void);
+  void report(void);
+
+private:
+  void readDevice(Device &device);
+  void decodeLine(Device &device);
+  bool flush(void);
+  void closeDevice(Device &device);
+
+  std::string          m_directory;
+  int                  m_epoll;
+  Column               m_time;
+  Column               m_device;
+  Column               m_co2;
+  Column               m_local;
+  uint32_t             m_rows;        // rows in the store, including the buffered ones
+  size_t               m_open;        // devices still open
+  std::vector<Device*> m_devices;
+  std::map<std::string, uint16_t> m_numbers;
+};
+
+
+/*Function *************************************************************
+ * Name:    Collector::open
+ * purpose: opens (or creates) the column store in a directory
+ */
+bool Collector::open(const std::string &directory)
+{
+  m_directory = directory;
+  m_open = 0;
+  mkdir(directory.c_str(), 0755);
+  if (!openColumn(m_time, directory, "time.col"))     return false;
+  if (!openColumn(m_device, directory, "device.col")) return false;
+  if (!openColumn(m_co2, directory, "co2.col"))       return false;
+  if (!openColumn(m_local, directory, "local.col"))   return false;
+  // An interrupted write can leave a partial row, the shortest column decides.
+  // Cut all columns back to it so the rows line up again, and drop the index
+  // entries of the rows that are gone.
+  m_rows = fileSize(directory + "/time.col") / sizeof(int64_t);
+  const char *names[] = { "device.col", "co2.col", "local.col" };
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+    uint32_t rows = fileSize(directory + "/" + names[i]) / sizeof(uint16_t);
+    if (rows < m_rows) m_rows = rows;
+    }
+  if (!truncateColumn(m_time, m_rows, sizeof(int64_t))    || !truncateColumn(m_device, m_rows, sizeof(uint16_t))
+      || !truncateColumn(m_co2, m_rows, sizeof(uint16_t)) || !truncateColumn(m_local, m_rows, sizeof(uint16_t)))
+    {
+    return false;
+    }
+  loadDeviceNumbers(directory, m_numbers);
+  for (std::map<std::string, uint16_t>::iterator known = m_numbers.begin(); known != m_numbers.end(); ++known)
+    {
+    char indexName[32];
+    snprintf(indexName, sizeof(indexName), "/device-%u.idx", known->second);
+    if (!trimIndex(directory + indexName, m_rows)) return false;
+    }
+
+  m_epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (m_epoll < 0)
+    {
+    perror("co2collect: epoll_create1");
+    return false;
+    }
+  return true;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    Collector::addDevice
+ * purpose: opens a serial port and adds it to the epoll set
+ */
+bool Collector::addDevice(const std::string &path)
+{
+  int fd = ::open(path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0)
+    {
+    fprintf(stderr, "co2collect: %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+    }
+  makeRaw(fd);
+
+  Device *device = new Device();
+  device->fd = fd;
+  device->path = path;
+  device->lineLength = 0;
+  device->lineTooLong = false;
+  device->readings = device->otherLines = device->badLines = 0;
+
+  std::map<std::string, uint16_t>::iterator known = m_numbers.find(path);
+  if (known != m_numbers.end())
+    {
+    device->number = known->second;
+    }
+  else
+    {
+    device->number = m_numbers.size();
+    m_numbers[path] = device->number;
+    FILE *file = fopen((m_directory + "/devices.txt").c_str(), "a");
+    if (file != NULL)
+      {
+      fprintf(file, "%u %s\n", device->number, path.c_str());
+      fclose(file);
+      }
+    }
+  char indexName[32];
+  snprintf(indexName, sizeof(indexName), "device-%u.idx", device->number);
+  if (!openColumn(device->index, m_directory, indexName))
+    {
+    close(fd);
+    delete device;
+    return false;
+    }
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = device;
+  if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) != 0)
+    {
+    fprintf(stderr, "co2collect: %s: %s\n", path.c_str(), strerror(errno));
+    close(fd);
+    close(device->index.fd);
+    delete device;
+    return false;
+    }
+  m_devices.push_back(device);
+  m_open++;
+  return true;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    Collector::decodeLine
+ * purpose: decodes one complete line of a device
+ */
+void Collector::decodeLine(Device &device)
+{
+  unsigned ppm, hour, minute;
+  char     extra;
+  device.line[device.lineLength] = 0;
+
+  if (device.line[0] != 'M')
+    {
+    device.otherLines++;
+    return;
+    }
+  if (sscanf(device.line, "M,%u,%u,%u%c", &ppm, &hour, &minute, &extra) != 3
+      || ppm > CO2_MAXIMUM || hour > 23 || minute > 59)
+    {
+    device.badLines++;
+    return;
+    }
+  appendValue<int64_t>(m_time, nowMicros());
+  appendValue<uint16_t>(m_device, device.number);
+  appendValue<uint16_t>(m_co2, ppm);
+  appendValue<uint16_t>(m_local, hour * 60 + minute);
+  appendValue<uint32_t>(device.index, m_rows);
+  m_rows++;
+  device.readings++;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    Collector::readDevice
+ * purpose: reads what a device has sent and splits it into lines
+ */
+void Collector::readDevice(Device &device)
+{
+  char data[READ_SIZE];
+  for (;;)
+    {
+    ssize_t length = read(device.fd, data, sizeof(data));
+    if (length < 0 && errno == EINTR) continue;
+    if (length < 0 && errno == EAGAIN) return;
+    if (length <= 0)
+      {
+      // end of file, or EIO when the other side of a pty is closed
+      closeDevice(device);
+      return;
+      }
+    for (ssize_t i = 0; i < length; i++)
+      {
+      char c = data[i];
+      if (c == '\r') continue;
+      if (c == '\n')
+        {
+        if (device.lineTooLong) device.badLines++;
+        else if (device.lineLength > 0) decodeLine(device);
+        device.lineLength = 0;
+        device.lineTooLong = false;
+        }
+      else if (device.lineLength < LINE_LENGTH - 1)
+        {
+        device.line[device.lineLength++] = c;
+        }
+      else
+        {
+        device.lineTooLong = true;
+        }
+      }
+    }
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    Collector::closeDevice
+ * purpose: stops reading a device that went away
+ */
+void Collector::closeDevice(Device &device)
+{
+  if (device.fd < 0) return;
+  epoll_ctl(m_epoll, EPOLL_CTL_DEL, device.fd, NULL);
+  close(device.fd);
+  device.fd = -1;
+  m_open--;
+  fprintf(stderr, "co2collect: %s closed\n", device.path.c_str());
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    Collector::flush
+ * purpose: writes all buffered columns. The data columns go first, so an
+ *          index never points past the end of the store.
+ */
+bool Collector::flush(void)
+{
+  bool ok = flushColumn(m_time) && flushColumn(m_device) && flushColumn(m_local) && flushColumn(m_co2);
+  for (size_t i = 0; i < m_devices.size(); i++)
+    {
+    ok = flushColumn(m_devices[i]->index) && ok;
+    }
+  return ok;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    Collector::run
+ * purpose: the event loop. Runs until a signal arrives or all devices
+ *          are closed.
+ * Outputs  exit code
+ */
+int Collector::run(void)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int64_t lastFlush = nowMicros();
+
+  while (!g_stop && m_open > 0)
+    {
+    int count = epoll_wait(m_epoll, events, MAX_EVENTS, FLUSH_INTERVAL);
+    if (count < 0 && errno != EINTR)
+      {
+      perror("co2collect: epoll_wait");
+      break;
+      }
+    for (int i = 0; i < count; i++)
+      {
+      readDevice(*(Device *) events[i].data.ptr);
+      }
+    int64_t now = nowMicros();
+    if (m_co2.buffer.size() >= FLUSH_SIZE || now - lastFlush >= FLUSH_INTERVAL * 1000LL)
+      {
+      if (!flush()) return 1;
+      lastFlush = now;
+      }
+    }
+  return flush() ? 0 : 1;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    Collector::report
+ * purpose: prints the counters per device on stderr
+ */
+void Collector::report(void)
+{
+  fprintf(stderr, "device readings other bad path\n");
+  for (size_t i = 0; i < m_devices.size(); i++)
+    {
+    Device *device = m_devices[i];
+    fprintf(stderr, "%6u %8lu %5lu %3lu %s\n", device->number, device->readings,
+            device->otherLines, device->badLines, device->path.c_str());
+    }
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    emulate
+ * purpose: stand in for a number of clocks. Every clock is a pty that
+ *          sends a reading every interval, the CO2 level walks up and down
+ *          like a room does. The slave names go to stdout.
+ * Inputs   number of clocks, interval in ms
+ * Outputs  exit code
+ */
+int emulate(int count, int interval)
+{
+  std::vector<int>      masters;
+  std::vector<unsigned> levels;
+
+  for (int i = 0; i < count; i++)
+    {
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+      {
+      perror("co2collect: posix_openpt");
+      return 1;
+      }
+    // make the slave raw now, so nothing is echoed before the collector opens it
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave >= 0)
+      {
+      makeRaw(slave);
+      close(slave);
+      }
+    printf("%s\n", ptsname(master));
+    masters.push_back(master);
+    levels.push_back(420 + rand() % 400);
+    }
+  fflush(stdout);
+
+  unsigned long sent = 0;
+  while (!g_stop)
+    {
+    time_t    now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    for (int i = 0; i < count; i++)
+      {
+      int step = rand() % 41 - 20;
+      if ((int) levels[i] + step > 400 && levels[i] + step < 3000) levels[i] += step;
+      char line[LINE_LENGTH];
+      int length = snprintf(line, sizeof(line), "M,%u,%d,%d\r\n", levels[i], local.tm_hour, local.tm_min);
+      // a full buffer means nobody is reading, the reading is lost as on the real clock
+      if (write(masters[i], line, length) == length) sent++;
+      char drain[256];
+      while (read(masters[i], drain, sizeof(drain)) > 0) {}
+      }
+    struct timespec pause = { interval / 1000, (interval % 1000) * 1000000L };
+    nanosleep(&pause, NULL);
+    }
+  fprintf(stderr, "co2collect: %lu readings sent\n", sent);
+  return 0;
+}
+/***********************************************************************/
+
+
+/*Function *************************************************************
+ * Name:    usage
+ */
+int usage(void)
+{
+  fprintf(stderr, "usage: co2collect -o <directory> <device> [<device> ...]\n"
+                  "       co2collect --emulate <count> [--interval <ms>]\n");
+  return 2;
+}
+/***********************************************************************/
+
+
+int main(int argc, char **argv)
+{
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onSignal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (argc >= 3 && strcmp(argv[1], "--emulate") == 0)
+    {
+    int interval = EMULATE_INTERVAL;
+    if (argc == 5 && strcmp(argv[3], "--interval") == 0) interval = atoi(argv[4]);
+    else if (argc != 3) return usage();
+    int count = atoi(argv[2]);
+    if (count <= 0 || interval <= 0) return usage();
+    return emulate(count, interval);
+    }
+
+  if (argc < 4 || strcmp(argv[1], "-o") != 0) return usage();
+
+  Collector collector;
+  if (!collector.open(argv[2])) return 1;
+  for (int i = 3; i < argc; i++)
+    {
+    collector.addDevice(argv[i]);
+    }
+  int result = collector.run();
+  collector.report();
+  return result;
+}
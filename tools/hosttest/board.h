@@ -0,0 +1,157 @@
+/***********************************************************************
+ * A simulated clock for the host tests: the firmware of src/main.cpp on
+ * a board where every ms that passes in delay() or in the sleep
+ *   - runs the tick interrupt every TICK ms,
+ *   - lets the sensor measure boardLevel() in periods of 1004 ms while it
+ *     is powered. A period reports the level taken at its start: with 
+ *     CO2_PWM_INPUT it is sent as a PWM period at its end, without it the
+ *     sensor answers a request on the serial line with the last level 
+ *     after SENSOR_ANSWER_MS,
+ *   - moves the RTC along, from a start time set by the test,
+ *   - sends the IR keys the test put in with boardKey().
+ * The door switch is simPins[INPUT_DOOR]; a test sets it and calls 
+ * doorChanged() as the INT0 interrupt would.
+ ***********************************************************************/
+#pragma once
+#include <string>
+#include "../../src/main.cpp"
+
+const unsigned long SENSOR_PERIOD_MS = 1004;
+const unsigned long SENSOR_ANSWER_MS = 20;   // 9 bytes at 9600 baud and some
+
+unsigned int (*boardLevel)(void);            // the CO2 level the sensor measures
+bool          boardPowered;                  // the sensor had power in the last ms
+unsigned int  boardMeasuring;                // level of the running period
+unsigned int  boardMeasured;                 // level of the last whole period
+unsigned long boardAnswerAt;                 // simMillis of the answer to a request, 0 for none
+uint32_t      boardStartTime;                // unix time (UTC) at simMillis 0
+unsigned long boardTicks;                    // tick interrupts so far
+unsigned long boardKeyAt;                    // simMillis of the next key, 0 for none
+uint16_t      boardKeyCommand;
+
+/* True while the sensor has power. Without CO2_POWER_GATING it always has. */
+bool boardSensorPowered(void)
+{
+#ifdef CO2_POWER_GATING
+  return simPins[OUTPUT_CO2POWER] == HIGH;
+#else
+  return true;
+#endif
+}
+
+/* The sensor: a period starts at power up and every SENSOR_PERIOD_MS */
+bool boardSensor(void)
+{
+  bool interrupt = false;
+  bool powered   = boardSensorPowered() && boardLevel;
+  if (powered && !boardPowered)
+    {
+    boardMeasuring = boardLevel();
+    boardMeasured  = boardMeasuring;
+    }
+  else if (powered && simMillis % SENSOR_PERIOD_MS == 0)
+    {
+    boardMeasured  = boardMeasuring;
+    boardMeasuring = boardLevel();
+#ifdef CO2_PWM_INPUT
+    postEventOnce(EVT_CO2, boardMeasured);      // as pwmCapture() does
+    interrupt = true;
+#endif
+    }
+  boardPowered = powered;
+
+#ifndef CO2_PWM_INPUT
+  // the board is the other end of the serial line: it takes what was sent
+  byte request[INIT_CO2_LENGTH];
+  for (byte i = 0; i < INIT_CO2_LENGTH; i++) request[i] = INIT_CO2[i];
+  if (simSerialLength >= INIT_CO2_LENGTH 
+      && memcmp(simSerialOut + simSerialLength - INIT_CO2_LENGTH, request, INIT_CO2_LENGTH) == 0)
+    {
+    boardAnswerAt = powered ? simMillis + SENSOR_ANSWER_MS : 0;
+    }
+  simSerialLength = 0;
+  if (!powered) boardAnswerAt = 0;              // switched off before it answered
+  if (boardAnswerAt != 0 && simMillis >= boardAnswerAt)
+    {
+    byte answer[INIT_CO2_LENGTH] = {0xFF, 0x86, (byte) (boardMeasured >> 8), (byte) boardMeasured};
+    for (byte i = 1; i < 8; i++) answer[8] += answer[i];
+    answer[8] = 0xFF - answer[8] + 1;
+    simSerialInput(answer, INIT_CO2_LENGTH);
+    boardAnswerAt = 0;
+    interrupt = true;
+    }
+#endif
+  return interrupt;
+}
+
+bool boardMillis(void)
+{
+  bool interrupt = false;
+  simRtcTime = boardStartTime + simMillis / 1000;
+  if (simMillis % TICK == 0)
+    {
+#ifdef CO2_PWM_INPUT
+    TIMER1_COMPA_vect();
+#else
+    TIMER1_OVF_vect();
+#endif
+    boardTicks++;
+    interrupt = true;
+    }
+  if (boardSensor()) interrupt = true;
+  if (boardKeyAt != 0 && simMillis >= boardKeyAt)
+    {
+    boardKeyAt = 0;
+    simIrFrame(NEC, 0x00, boardKeyCommand, 0);
+    irFrameReceived();
+    interrupt = true;
+    }
+  return interrupt;
+}
+
+/* Sends the NEC key of the remote at a time */
+void boardKey(unsigned long at, uint16_t command)
+{
+  boardKeyAt      = at;
+  boardKeyCommand = command;
+}
+
+/* Powers the board up and runs setup() */
+void boardStart(uint32_t startTime)
+{
+  boardStartTime = startTime;
+  simRtcTime     = startTime;
+  simOnMillis    = boardMillis;
+  setup();
+}
+
+/* Runs loop() until a time */
+void boardRun(unsigned long until)
+{
+  while (simMillis < until) loop();
+}
+
+#ifdef CO2_POWER_GATING
+/* Runs loop() up to the last tick of the next warm up */
+void boardRunToWarmupEnd(void)
+{
+  while (g_sensorPower.state != SENSOR_WARMUP || g_sensorPower.countdown != 1) loop();
+}
+#endif
+
+/* The lines of printDiagnostics() that start with a letter */
+std::string boardDiagnostics(char letter)
+{
+  simSerialLength = 0;
+  printDiagnostics();
+  std::string lines;
+  const char *line = simSerialOut;
+  while (line < simSerialOut + simSerialLength)
+    {
+    const char *end = (const char *) memchr(line, '\n', simSerialOut + simSerialLength - line);
+    if (end == NULL) end = simSerialOut + simSerialLength;
+    if (*line == letter) lines.append(line, end - line + 1);
+    line = end + 1;
+    }
+  return(lines);
+}
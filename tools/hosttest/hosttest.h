@@ -0,0 +1,18 @@
+/***********************************************************************
+ * Checks for the host tests. A test is one program that includes the 
+ * firmware (declarations.h and functions.h) and the stand-ins of 
+ * tools/stubs, and returns 0 when all checks passed.
+ ***********************************************************************/
+#pragma once
+#include <stdio.h>
+
+static int checkFailures;
+
+#define CHECK(condition) \
+  do { if (!(condition)) { printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); checkFailures++; } } while (0)
+
+static inline int checkReport(const char *name)
+{
+  printf("%s: %s\n", name, checkFailures ? "FAILED" : "passed");
+  return checkFailures ? 1 : 0;
+}
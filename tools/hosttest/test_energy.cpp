@@ -0,0 +1,105 @@
+/***********************************************************************
+ * Energy account and event queue on the simulated clock (board.h).
+ * A cold boot with the door open: the start up animation takes 24 ticks
+ * and the door event of setup() must still come through, and the clock 
+ * must run on after the door is closed. The account of a run is the same
+ * for the same inputs, so a change in the Q lines is a change of the 
+ * firmware.
+ ***********************************************************************/
+#include "board.h"
+#include "hosttest.h"
+#include <sys/wait.h>
+#include <unistd.h>
+
+const uint32_t      START_TIME   = 1700000000UL;   // 14 Nov 2023, 22:13 UTC
+const unsigned long DOOR_OPEN_MS = 5000;            // door shown open this long
+const unsigned long RUN_MS       = 20UL * 60 * 1000;
+
+unsigned long g_doorShownAt;
+unsigned long g_clockDrawnAfterDoor;
+
+unsigned int roomLevel(void)
+{
+  return 600 + (simMillis / 1000) % 300;          // a room filling up, below the warning level
+}
+
+bool testMillis(void)
+{
+  if (simPins[INPUT_DOOR] == HIGH)
+    {
+    if (g_doorShownAt == 0 && g_errorShown == ERROR_DOOR_OPEN) g_doorShownAt = simMillis;
+    if ((g_doorShownAt != 0 && simMillis - g_doorShownAt >= DOOR_OPEN_MS) || simMillis > 60000)
+      {
+      simPins[INPUT_DOOR] = LOW;                  // close the door, also when it was never shown
+      doorChanged();
+      }
+    }
+  else if (g_clockDrawnAfterDoor == 0 && g_doorShownAt != 0 && g_errorShown == 0)
+    {
+    g_clockDrawnAfterDoor = simMillis;
+    }
+  return(boardMillis());
+}
+
+/* A cold boot with the door open, 20 minutes with the display off for 
+   the middle 5 */
+void runScenario(void)
+{
+  boardLevel = roomLevel;
+  simPins[INPUT_DOOR] = HIGH;
+  boardStart(START_TIME);
+  simOnMillis = testMillis;
+  boardKey(8UL * 60 * 1000, 0x16);                // KEY_AST, display off
+  boardRun(13UL * 60 * 1000);
+  boardKey(13UL * 60 * 1000 + 100, 0x0D);         // KEY_HASH, on again
+  boardRun(RUN_MS);
+}
+
+/* Runs the scenario in a child process and returns its Q lines */
+std::string accountOfRun(void)
+{
+  int channel[2];
+  if (pipe(channel) != 0) return("");
+  pid_t child = fork();
+  if (child == 0)
+    {
+    runScenario();
+    std::string lines = boardDiagnostics('Q');
+    if (write(channel[1], lines.data(), lines.size()) < 0) _exit(1);
+    _exit(0);
+    }
+  close(channel[1]);
+  std::string lines;
+  char buffer[256];
+  ssize_t length;
+  while ((length = read(channel[0], buffer, sizeof(buffer))) > 0) lines.append(buffer, length);
+  close(channel[0]);
+  waitpid(child, NULL, 0);
+  return(lines);
+}
+
+int main()
+{
+  // the same run twice gives the same account
+  std::string first  = accountOfRun();
+  std::string second = accountOfRun();
+  printf("%s", first.c_str());
+  CHECK(first.size() > 0);
+  CHECK(first == second);
+
+  runScenario();
+  printf("test_energy: door shown at %lu ms, clock drawn again at %lu ms, %u lost events, peak %u\n",
+         g_doorShownAt, g_clockDrawnAfterDoor, g_eventOverflows, g_eventPeak);
+  CHECK(g_eventOverflows == 0);
+  CHECK(g_doorShownAt != 0);                      // the door event of setup() came through
+  CHECK(g_clockDrawnAfterDoor != 0);              // the timers survived the open door
+  CHECK(g_clockDrawnAfterDoor - g_doorShownAt < DOOR_OPEN_MS + 2 * Timer2Value * TICK);
+
+  // every tick is in the account, also those of the animation and the open door
+  unsigned long ticks = 0;
+  for (byte mode = 0; mode < NUMBER_OF_ENERGY_MODES; mode++) ticks += g_energy.account[mode].ticks;
+  CHECK(ticks + g_pendingTicks == boardTicks);
+  CHECK(g_energy.account[ENERGY_OFF].ticks >= 5UL * 60 * 1000 / TICK - 10);
+
+  return(checkReport("test_energy"));
+}
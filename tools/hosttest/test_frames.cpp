@@ -0,0 +1,126 @@
+/***********************************************************************
+ * Frame transmission against IR reception: the ring is redrawn every ms
+ * while NEC frames (68 ms) come in at random gaps. A strip.show() in the
+ * middle of an IR frame loses its key. Some IR frames start in
+ * transmitFrame(), after the first check of the receiver in flushFrame().
+ ***********************************************************************/
+#include <Arduino.h>
+#include "declarations.h"
+#include "functions.h"
+#include "hosttest.h"
+
+const unsigned long IR_FRAME_MS = 68;
+const unsigned long RUN_MS      = 600000UL;     // 10 minutes
+
+unsigned long g_irStart;                 // start of the current or next IR frame
+bool          g_irActive;
+bool          g_irHit;                   // a frame was sent during this IR frame
+unsigned long g_irFrames, g_lostKeys, g_startsInEstimate;
+uint32_t      g_random = 12345;
+
+unsigned long nextRandom(unsigned long range)
+{
+  g_random = g_random * 1103515245UL + 12345;
+  return (g_random >> 8) % range;
+}
+
+void irStart(void)
+{
+  g_irStart  = simMillis;
+  g_irActive = true;
+  g_irHit    = false;
+  IrReceiver.irparams.StateForISR = IR_REC_STATE_MARK;
+}
+
+/* Half of the IR frames that are due in the next ms start when 
+   transmitFrame() takes the pixel buffer instead */
+void onGetPixels(void)
+{
+  if (!g_irActive && g_irStart == simMillis + 1 && nextRandom(2) == 0)
+    {
+    irStart();
+    g_startsInEstimate++;
+    }
+}
+
+void onShow(void)
+{
+  if (g_irActive) g_irHit = true;
+}
+
+int main()
+{
+  simOnShow      = onShow;
+  simOnGetPixels = onGetPixels;
+  g_irStart      = 20;
+  unsigned long longestPending = 0;
+
+  for (simMillis = 0; simMillis < RUN_MS; simMillis++)
+    {
+    // the receiver
+    if (!g_irActive && simMillis >= g_irStart) irStart();
+    if (g_irActive && simMillis - g_irStart >= IR_FRAME_MS)
+      {
+      g_irActive = false;
+      IrReceiver.irparams.StateForISR = IR_REC_STATE_IDLE;
+      irFrameReceived();
+      g_irFrames++;
+      if (g_irHit) g_lostKeys++;
+      g_irStart = simMillis + 5 + nextRandom(200);
+      }
+    else if (g_irActive)
+      {
+      IrReceiver.irparams.StateForISR = ((simMillis - g_irStart) & 1) ? IR_REC_STATE_SPACE : IR_REC_STATE_MARK;
+      }
+
+    // the main loop: a redraw every ms, and the held frame
+    strip.setPixelColor(simMillis % 61, simMillis & 0xFF);
+    showFrame();
+    flushFrame();
+    if (g_frameSync.pending && simMillis - g_frameSync.since > longestPending) longestPending = simMillis - g_frameSync.since;
+    Event event;
+    while (getEvent(&event)) {}
+    }
+
+  printf("test_frames: %lu IR frames, %lu started in transmitFrame(), %lu keys lost, %lu frames shown\n",
+         g_irFrames, g_startsInEstimate, g_lostKeys, simShows);
+  CHECK(g_irFrames > 3000);
+  CHECK(g_startsInEstimate > 100);
+  CHECK(g_lostKeys == 0);
+  CHECK(g_frameSync.forcedFrames == 0);
+  CHECK(g_frameSync.protectedIrFrames == g_irFrames);
+  CHECK(longestPending <= IR_FRAME_MS);
+  CHECK(simShows > RUN_MS / 4);
+
+  // a frame over the current budget is dimmed when it is sent, the buffer
+  // keeps the picture: a partial redraw after it matches a full redraw
+  simOnShow      = 0;
+  simOnGetPixels = 0;
+  IrReceiver.irparams.StateForISR = IR_REC_STATE_IDLE;
+  strip.setBrightness(200);
+  for (byte i = 0; i < NUMBER_OF_PIXELS; i++) strip.setPixelColor(i, 0xFFFFFF);
+  byte picture[NUMBER_OF_PIXELS * 3];
+  memcpy(picture, strip.getPixels(), sizeof(picture));
+  unsigned long limited = g_ledCurrent.limitedFrames;
+  showFrame();
+  CHECK(g_ledCurrent.limitedFrames == limited + 1);
+  CHECK(!g_frameSync.pending);
+  CHECK(strip.getBrightness() == 200);
+  CHECK(memcmp(picture, strip.getPixels(), sizeof(picture)) == 0);
+  strip.setPixelColor(RING5, 0xFFFFFF);
+  CHECK(memcmp(picture, strip.getPixels(), sizeof(picture)) == 0);
+
+  // held back by the receiver, such a frame is left alone until it is sent
+  IrReceiver.irparams.StateForISR = IR_REC_STATE_MARK;
+  showFrame();
+  CHECK(g_frameSync.pending);
+  CHECK(g_ledCurrent.limitedFrames == limited + 1);
+  CHECK(strip.getBrightness() == 200);
+  CHECK(memcmp(picture, strip.getPixels(), sizeof(picture)) == 0);
+  IrReceiver.irparams.StateForISR = IR_REC_STATE_IDLE;
+  CHECK(flushFrame());
+  CHECK(g_ledCurrent.limitedFrames == limited + 2);
+  CHECK(memcmp(picture, strip.getPixels(), sizeof(picture)) == 0);
+
+  return(checkReport("test_frames"));
+}
@@ -0,0 +1,94 @@
+/***********************************************************************
+ * Sensor power gating on the simulated clock (board.h), with a model of
+ * the MH-Z19B: after a power up it reports 400 ppm during its preheat of 
+ * SENSOR_PREHEAT_MS, then the level of the room. The room is at 1400 ppm 
+ * from midnight to 5 o'clock and at 600 ppm otherwise. No preheat value 
+ * may reach the statistics, and the statistics must see the night as it
+ * was, although the sensor only samples 30 s every 10 minutes. Timer 1
+ * reads the level 1 s after every window opens, when the last PWM period
+ * still started in the warm up.
+ ***********************************************************************/
+#include "board.h"
+#include "hosttest.h"
+
+const uint32_t      START_TIME        = 1699995600UL;   // 14 Nov 2023, 22:00 CET
+const unsigned long SENSOR_PREHEAT_MS = SENSOR_WARMUP_TICKS * TICK;
+const unsigned long HOUR_MS           = 3600000UL;
+
+unsigned long g_poweredSince;
+bool          g_powered;
+unsigned long g_preheatReadings;
+
+byte localHour(void)
+{
+  return(((simRtcTime + 3600) / 3600) % 24);       // CET, no summer time in November
+}
+
+unsigned int sensorLevel(void)
+{
+  if (simMillis - g_poweredSince < SENSOR_PREHEAT_MS)
+    {
+    g_preheatReadings++;
+    return(400);
+    }
+  return(localHour() < 5 ? 1400 : 600);
+}
+
+bool testMillis(void)
+{
+  bool powered = simPins[OUTPUT_CO2POWER] == HIGH;
+  if (powered && !g_powered) g_poweredSince = simMillis;
+  g_powered = powered;
+  return(boardMillis());
+}
+
+/* Minutes above 1000 ppm in a statistics block */
+unsigned long minutesAboveWarn(byte block)
+{
+  return(((uint32_t) g_co2Stats[block].aboveWarn * SAMPLE_TIME) / 60000UL);
+}
+
+int main()
+{
+  boardLevel = sensorLevel;
+  simPins[OUTPUT_CO2POWER] = HIGH;                 // the sensor is on at power up
+  boardStart(START_TIME);
+  simOnMillis = testMillis;
+
+  // the first night: the schedule repeats every GATING_PERIOD_TICKS
+  boardRun(HOUR_MS);
+  boardRunToWarmupEnd();
+  g_timers[1].Count = 3;
+
+  // 04:59 of the first night: the hour block holds a gated hour at 1400 ppm
+  boardRun(7 * HOUR_MS - 60000);
+  printf("test_gating: 04:59, hour %u: %lu minutes above 1000 ppm, mean %lu\n", g_co2Stats[STATS_HOUR].period,
+         minutesAboveWarn(STATS_HOUR), (unsigned long) (g_co2Stats[STATS_HOUR].sum / g_co2Stats[STATS_HOUR].count));
+  CHECK(g_co2Stats[STATS_HOUR].period == 4);
+  CHECK(minutesAboveWarn(STATS_HOUR) >= 50 && minutesAboveWarn(STATS_HOUR) <= 60);
+  CHECK(g_co2Stats[STATS_HOUR].minimum == 1400);
+
+  // 23:30 of the next day: the day block holds the whole night and the day
+  boardRun(25 * HOUR_MS + 30 * 60000UL);
+  unsigned long mean = g_co2Stats[STATS_DAY].sum / g_co2Stats[STATS_DAY].count;
+  printf("test_gating: 23:30, day %u: %lu minutes above 1000 ppm, mean %lu, minimum %u\n", g_co2Stats[STATS_DAY].period,
+         minutesAboveWarn(STATS_DAY), mean, g_co2Stats[STATS_DAY].minimum);
+  CHECK(minutesAboveWarn(STATS_DAY) >= 290 && minutesAboveWarn(STATS_DAY) <= 305);
+  CHECK(mean >= 760 && mean <= 790);              // 5 h at 1400, 18.5 h at 600: 770
+  CHECK(g_co2Stats[STATS_DAY].minimum == 600);    // no preheat reading got through
+  CHECK(g_preheatReadings > 0);
+  CHECK(g_sensorPower.discarded > 0);
+
+  // the next day, the counters of yesterday: 8 hours of night
+  boardRun(27 * HOUR_MS);
+  unsigned long offSeconds = g_sensorPower.offTicks[YESTERDAY] * TICK / 1000;
+  printf("test_gating: yesterday %lu s off, %u power ups, %u readings dropped\n", offSeconds,
+         g_sensorPower.powerUps[YESTERDAY], g_sensorPower.discarded);
+  printf("%s", boardDiagnostics('G').c_str());
+  CHECK(offSeconds >= 18000 && offSeconds <= 19500);   // 48 * 6.5 minutes
+  CHECK(g_sensorPower.powerUps[YESTERDAY] >= 47 && g_sensorPower.powerUps[YESTERDAY] <= 49);
+  CHECK(boardDiagnostics('G').size() > 0);
+  CHECK(g_eventOverflows == 0);
+
+  return(checkReport("test_gating"));
+}
@@ -0,0 +1,83 @@
+/***********************************************************************
+ * Sensor power gating with the sensor on the serial line (board.h), the
+ * sensor model of test_gating: 400 ppm during the preheat, then 600 ppm.
+ * Timer 1 is set to expire on the last tick of a night warm up, and so
+ * on the last tick of every window too:
+ *   - the request of the last warm up tick is answered in the window,
+ *     the answer must still be dropped,
+ *   - the request of the last window tick is still open when the sensor
+ *     is switched off, the time out after it is no link error.
+ ***********************************************************************/
+#include "board.h"
+#include "hosttest.h"
+
+const uint32_t      START_TIME        = 1699995600UL;   // 14 Nov 2023, 22:00 CET
+const unsigned long SENSOR_PREHEAT_MS = SENSOR_WARMUP_TICKS * TICK;
+const unsigned long HOUR_MS           = 3600000UL;
+
+unsigned long g_poweredSince;
+bool          g_powered;
+unsigned long g_preheatReadings;
+unsigned long g_preheatLevels;           // preheat levels that got through
+unsigned long g_pendingAtWindow;         // requests open when a window opened
+unsigned long g_pendingAtOff;            // requests open when the sensor went off
+
+unsigned int sensorLevel(void)
+{
+  if (simMillis - g_poweredSince < SENSOR_PREHEAT_MS)
+    {
+    g_preheatReadings++;
+    return(400);
+    }
+  return(600);
+}
+
+bool testMillis(void)
+{
+  bool powered = simPins[OUTPUT_CO2POWER] == HIGH;
+  if (powered && !g_powered) g_poweredSince = simMillis;
+  g_powered = powered;
+  return(boardMillis());
+}
+
+/* Runs loop() until a time and watches the state changes */
+void run(unsigned long until)
+{
+  while (simMillis < until)
+    {
+    byte state = g_sensorPower.state;
+    loop();
+    if (g_co2Level == 400) g_preheatLevels++;
+    if (state == SENSOR_WARMUP && g_sensorPower.state == SENSOR_SAMPLING && g_co2RequestPending) g_pendingAtWindow++;
+    if (state == SENSOR_SAMPLING && g_sensorPower.state == SENSOR_OFF && g_co2RequestPending) g_pendingAtOff++;
+    }
+}
+
+int main()
+{
+  boardLevel = sensorLevel;
+  simPins[OUTPUT_CO2POWER] = HIGH;                 // the sensor is on at power up
+  g_powered = true;
+  boardStart(START_TIME);
+  simOnMillis = testMillis;
+
+  // the first night: the schedule repeats every GATING_PERIOD_TICKS
+  run(HOUR_MS);
+  boardRunToWarmupEnd();
+  g_timers[1].Count = 1;
+
+  // until 5 o'clock
+  run(7 * HOUR_MS);
+  printf("test_gating_uart: %lu requests, %u time outs, %lu open at a window, %lu open at switch off, %u readings dropped\n",
+         g_linkHealth.requests, g_linkHealth.timeouts, g_pendingAtWindow, g_pendingAtOff, g_sensorPower.discarded);
+  CHECK(g_pendingAtWindow >= 30);                  // every window of the night
+  CHECK(g_pendingAtOff >= 30);
+  CHECK(g_preheatReadings > 0);
+  CHECK(g_preheatLevels == 0);                     // no preheat reading got through
+  CHECK(g_co2Stats[STATS_HOUR].minimum == 600);
+  CHECK(g_linkHealth.timeouts == 0);
+  CHECK(g_linkHealth.shortReads == 0 && g_linkHealth.checksumErrors == 0);
+  CHECK(g_eventOverflows == 0);
+
+  return(checkReport("test_gating_uart"));
+}
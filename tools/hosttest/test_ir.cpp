@@ -0,0 +1,99 @@
+/***********************************************************************
+ * IR keymaps: frames the IR library could not decode and commands above
+ * 0xFF are not keys and are not learned, and forgetting the learned 
+ * remotes needs a confirmation.
+ ***********************************************************************/
+#include <Arduino.h>
+#include "declarations.h"
+#include "functions.h"
+#include "hosttest.h"
+
+const uint32_t SONY_VOLUME = irCode(SONY, 0x01, 0x12);
+const uint32_t NOISE       = irCode(UNKNOWN, 0, 0);
+
+/* Puts a key in the learned keymap and starts command mode */
+void learnedAndCommandMode(void)
+{
+  forgetLearnedKeys();
+  IrKey irKey = {SONY_VOLUME, 5};
+  storeLearnedKey(irKey);
+  g_runMode     = CMD;
+  g_digitCount  = 0;
+  g_forgetArmed = false;
+}
+
+void cmdKey(byte key)
+{
+  cmdTimeCommandProcessing(key);
+}
+
+int main()
+{
+  // noise is no key, also when an older build learned it
+  forgetLearnedKeys();
+  IrKey noiseKey = {NOISE, KEY_AST};
+  storeLearnedKey(noiseKey);
+  CHECK(lookupIrKey(NOISE) == NO_CMD);
+  CHECK(lookupIrKey(irCode(UNKNOWN, 0x12, 0x34)) == NO_CMD);
+  CHECK(lookupIrKey(irCode(NEC, 0x00, 0x16)) == KEY_AST);
+
+  // and it is not learned
+  forgetLearnedKeys();
+  g_runMode    = LEARN;
+  g_learnCount = 0;
+  simIrFrame(UNKNOWN, 0, 0, 0);
+  receiveIR();
+  CHECK(g_learnCount == 0);
+  simIrFrame(SONY, 0x01, 0x00, 0);
+  receiveIR();
+  CHECK(g_learnCount == 1);
+  CHECK(lookupIrKey(irCode(SONY, 0x01, 0x00)) == IR_LEARN_ORDER[0]);
+  simIrFrame(UNKNOWN, 0, 0, 0);
+  receiveIR();
+  CHECK(g_learnCount == 1);
+
+  // a 16 bit command is not cut to the low byte: 0x0116 is not the 
+  // built-in "*" (0x16), and it is not learned either
+  CHECK(lookupIrKey(irCode(NEC, 0x00, 0x0116)) == NO_CMD);
+  simIrFrame(NEC, 0x00, 0x0116, 0);
+  CHECK(receiveIR() == NO_CMD);
+  CHECK(g_learnCount == 1);
+
+  // "*" alone forgets nothing, "*" "*" does
+  learnedAndCommandMode();
+  cmdKey(KEY_AST);
+  CHECK(lookupIrKey(SONY_VOLUME) == 5);
+  CHECK(g_runMode == CMD);
+  CHECK(strip.getPixelColor(RING1) != 0);
+  cmdKey(KEY_AST);
+  CHECK(lookupIrKey(SONY_VOLUME) == NO_CMD);
+  CHECK(g_runMode == RUN);
+
+  // "*" OK does too
+  learnedAndCommandMode();
+  cmdKey(KEY_AST);
+  cmdKey(KEY_OK);
+  CHECK(lookupIrKey(SONY_VOLUME) == NO_CMD);
+  CHECK(g_runMode == RUN);
+
+  // another key cancels
+  learnedAndCommandMode();
+  cmdKey(KEY_AST);
+  cmdKey(3);
+  CHECK(lookupIrKey(SONY_VOLUME) == 5);
+  CHECK(g_runMode == RUN);
+  CHECK(!g_forgetArmed);
+
+  // and so does the time out
+  learnedAndCommandMode();
+  cmdKey(KEY_AST);
+  g_timers[3].Over = true;
+  commandTimeout();
+  CHECK(g_runMode == RUN);
+  CHECK(!g_forgetArmed);
+  g_runMode = CMD;
+  cmdKey(KEY_AST);
+  CHECK(lookupIrKey(SONY_VOLUME) == 5);
+
+  return(checkReport("test_ir"));
+}
@@ -0,0 +1,145 @@
+/***********************************************************************
+ * PWM acquisition (CO2_PWM_INPUT): synthetic MH-Z19 waveforms go through
+ * pwmCapture() on a model of timer 1 in CTC mode. The time line counts 
+ * timer counts of 16 us from the start and does not wrap; the firmware 
+ * sees the capture register and the 16 bit tick count.
+ ***********************************************************************/
+#include <Arduino.h>
+#include "declarations.h"
+#include "functions.h"
+#include "hosttest.h"
+
+const uint32_t TICK_COUNTS = T1_TOP + 1;
+
+/* Captures an edge at a point of the time line. With lateTick the edge 
+   comes just after a compare match whose interrupt did not run yet. */
+void edgeAt(uint64_t counts, bool lateTick)
+{
+  g_tickCount = (uint16_t) (counts / TICK_COUNTS);
+  TIFR1       = 0;
+  if (lateTick)
+    {
+    g_tickCount--;
+    TIFR1 = (1 << OCF1A);
+    }
+  ICR1 = counts % TICK_COUNTS;
+  pwmCapture();
+}
+
+/* The high time of a level as the sensor sends it */
+uint32_t highTime(unsigned int ppm, uint32_t period)
+{
+  return(PWM_COUNTS_2MS + (uint32_t) ppm * (period - 2 * PWM_COUNTS_2MS) / CO2_PWM_RANGE);
+}
+
+/* Sends periods of a level after the rising edge at start, each a falling
+   and the next rising edge. Returns the last rising edge. */
+uint64_t wave(uint64_t start, unsigned int ppm, uint32_t period, byte periods)
+{
+  for (byte i = 0; i < periods; i++)
+    {
+    edgeAt(start + highTime(ppm, period), false);
+    start += period;
+    edgeAt(start, false);
+    }
+  return(start);
+}
+
+/* The level of the last EVT_CO2 in the queue, or -1 */
+long lastLevel(void)
+{
+  Event event;
+  long  level = -1;
+  while (getEvent(&event))
+    {
+    if (event.type == EVT_CO2) level = event.data;
+    }
+  return(level);
+}
+
+/* Starts the capture with a rising edge at a point of the time line. The
+   first period is partial and does not count. */
+void startCapture(uint64_t counts, bool lateTick = false)
+{
+  TCCR1B = TCCR1B_PWM;
+  edgeAt(counts, lateTick);
+  lastLevel();
+  g_pwmInvalid = 0;
+}
+
+int main()
+{
+  // levels over the whole range
+  uint64_t now = 1000;
+  for (unsigned int ppm = 0; ppm <= CO2_PWM_RANGE; ppm += 100)
+    {
+    startCapture(now);
+    now = wave(now, ppm, PWM_PERIOD, 1);
+    long level = lastLevel();
+    CHECK(level >= (long) ppm - 1 && level <= (long) ppm + 1);
+    }
+
+  // periods of +/- 4% are fine
+  startCapture(now);
+  now = wave(now, 1500, PWM_PERIOD * 96 / 100, 3);
+  CHECK(lastLevel() == 1500);
+  now = wave(now, 1500, PWM_PERIOD * 104 / 100, 3);
+  CHECK(lastLevel() == 1500);
+  CHECK(g_pwmInvalid == 0);
+
+  // across the wrap of the 16 bit tick count (every 9.1 hours), several 
+  // phases of the wrap against the edges
+  for (uint32_t phase = 0; phase < PWM_PERIOD; phase += 997)
+    {
+    now = 65534ULL * TICK_COUNTS + phase;
+    startCapture(now);
+    now = wave(now, 800, PWM_PERIOD, 5);
+    CHECK(now / TICK_COUNTS > 65536);
+    CHECK(g_pwmInvalid == 0);
+    CHECK(lastLevel() == 800);
+    }
+
+  // a second wrap, the time stamps only depend on the tick count modulo 65536
+  now = 2 * 65536ULL * TICK_COUNTS - 3 * TICK_COUNTS + 17;
+  startCapture(now);
+  now = wave(now, 2400, PWM_PERIOD, 4);
+  CHECK(g_pwmInvalid == 0);
+  CHECK(lastLevel() == 2400);
+
+  // edges just after a compare match, before the tick interrupt ran
+  uint32_t high = highTime(1000, PWM_PERIOD);
+  uint64_t rise = 12ULL * TICK_COUNTS + 5;
+  startCapture(rise, true);
+  edgeAt(rise + high, false);
+  edgeAt(rise + PWM_PERIOD, false);
+  CHECK(lastLevel() == 1000);
+  uint64_t fall = 20ULL * TICK_COUNTS + 3;
+  startCapture(fall - high);
+  edgeAt(fall, true);
+  edgeAt(fall - high + PWM_PERIOD, false);
+  CHECK(lastLevel() == 1000);
+  CHECK(g_pwmInvalid == 0);
+
+  // and across the wrap
+  rise = 65536ULL * TICK_COUNTS + 2;
+  startCapture(rise, true);
+  edgeAt(rise + high, false);
+  edgeAt(rise + PWM_PERIOD, false);
+  CHECK(lastLevel() == 1000);
+  fall = 65536ULL * TICK_COUNTS + 7;
+  startCapture(fall - high);
+  edgeAt(fall, true);
+  edgeAt(fall - high + PWM_PERIOD, false);
+  CHECK(lastLevel() == 1000);
+  CHECK(g_pwmInvalid == 0);
+
+  // periods out of the specification are counted, not reported
+  startCapture(now);
+  now = wave(now, 1000, PWM_PERIOD * 80 / 100, 2);
+  CHECK(lastLevel() == -1);
+  CHECK(g_pwmInvalid == 2);
+  now = wave(now, 1000, PWM_PERIOD * 120 / 100, 1);
+  CHECK(g_pwmInvalid == 3);
+
+  return(checkReport("test_pwm"));
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <Arduino.h>
+#define NEO_GRB    0x52
+#define NEO_KHZ800 0x0000
+
+// Pixel buffer like the real library: setPixelColor() stores the colour 
+// scaled by the brightness, show() only counts.
+class Adafruit_NeoPixel
+{
+public:
+  Adafruit_NeoPixel(uint16_t n, int16_t pin, uint16_t type);
+  void     begin();
+  void     show();
+  void     clear();
+  void     setBrightness(uint8_t b);
+  uint8_t  getBrightness() const;
+  void     setPixelColor(uint16_t n, uint32_t c);
+  uint32_t getPixelColor(uint16_t n) const;
+  uint8_t *getPixels() const;
+  uint16_t numPixels() const;
+  static uint32_t Color(uint8_t r, uint8_t g, uint8_t b) { return ((uint32_t) r << 16) | ((uint32_t) g << 8) | b; }
+private:
+  uint16_t numLEDs;
+  uint8_t  brightness;
+  uint8_t *pixels;
+};
+
+extern unsigned long simShows;           // calls of show()
+extern void (*simOnShow)(void);          // called by show(), may be 0
+extern void (*simOnGetPixels)(void);     // called by getPixels(), may be 0
@@ -0,0 +1,98 @@
+/***********************************************************************
+ * Stand-in for the Arduino core, just enough to build declarations.h and
+ * functions.h outside the Arduino IDE:
+ *   on the host (tools/hosttest) with the avr-libc replacements in host/,
+ *   on the AVR  (tools/bench) with the real avr-libc.
+ * The sim* variables let a test drive the inputs and see the outputs.
+ ***********************************************************************/
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+typedef uint8_t byte;
+typedef bool    boolean;
+
+#define HIGH 1
+#define LOW  0
+#define INPUT        0
+#define OUTPUT       1
+#define INPUT_PULLUP 2
+#define A0 14
+#define CHANGE  1
+#define FALLING 2
+#define RISING  3
+#define DEC 10
+#define HEX 16
+#define F(x) (x)
+#define digitalPinToInterrupt(p) ((p) == 2 ? 0 : ((p) == 3 ? 1 : -1))
+
+#ifdef __AVR__
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#else
+#define F_CPU 16000000UL
+#define ISR(vector) extern "C" void vector(void)
+#define sei()
+#define cli()
+
+// Registers of the ATmega328P that the firmware uses
+extern volatile uint8_t  SREG, TCCR1A, TCCR1B, TIMSK1, TIFR1, MCUSR;
+extern volatile uint16_t TCNT1, ICR1, OCR1A;
+#define TOV1   0
+#define OCF1A  1
+#define ICF1   5
+#define TOIE1  0
+#define OCIE1A 1
+#define ICIE1  5
+#define CS12   2
+#define WGM12  3
+#define ICES1  6
+#define ICNC1  7
+#define PORF   0
+#define EXTRF  1
+#define BORF   2
+#define WDRF   3
+#endif
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int  digitalRead(uint8_t pin);
+int  analogRead(uint8_t pin);
+void delay(unsigned long ms);
+unsigned long millis(void);
+unsigned long micros(void);
+void attachInterrupt(uint8_t interrupt, void (*handler)(void), int mode);
+
+class HardwareSerial
+{
+public:
+  void   begin(unsigned long baud);
+  int    available();
+  int    read();
+  size_t write(uint8_t b);
+  void   flush();
+  size_t readBytes(uint8_t *buffer, size_t length);
+  size_t print(const char *s);
+  size_t print(char c);
+  size_t print(int n, int base = DEC);
+  size_t print(unsigned int n, int base = DEC);
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC);
+  size_t println();
+  template <typename T> size_t println(T value) { return print(value) + println(); }
+};
+extern HardwareSerial Serial;
+
+// Simulation
+extern unsigned long simMillis;          // millis(), micros() is 1000 times this plus simMicros
+extern unsigned long simMicros;
+extern bool        (*simOnMillis)(void); // called for every ms that delay() or sleep_cpu() let pass,
+                                         // returns true when it ran an interrupt; may be 0
+extern byte          simPins[20];        // last value written or to be read
+extern int           simAnalog;          // analogRead() of every pin
+#ifndef __AVR__
+extern char          simSerialOut[4096]; // everything printed, cut off when full
+extern size_t        simSerialLength;    // (on the AVR the output goes to the UART)
+#endif
+void simSerialInput(const uint8_t *data, size_t length);
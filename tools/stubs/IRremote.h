@@ -0,0 +1,32 @@
+#pragma once
+#include <Arduino.h>
+#define ENABLE_LED_FEEDBACK true
+#define IRDATA_FLAGS_IS_REPEAT      0x01
+#define IRDATA_FLAGS_IS_AUTO_REPEAT 0x02
+
+// Same order as IRremote 4.x
+typedef enum { UNKNOWN = 0, PULSE_WIDTH, PULSE_DISTANCE, APPLE, DENON, JVC, LG, LG2, NEC, NEC2,
+               ONKYO, PANASONIC, KASEIKYO, KASEIKYO_DENON, KASEIKYO_SHARP, KASEIKYO_JVC,
+               KASEIKYO_MITSUBISHI, RC5, RC6, SAMSUNG, SAMSUNG48, SAMSUNG_LG, SHARP, SONY } decode_type_t;
+
+#define IR_REC_STATE_IDLE  0
+#define IR_REC_STATE_MARK  1
+#define IR_REC_STATE_SPACE 2
+#define IR_REC_STATE_STOP  3
+
+struct IRData          { decode_type_t protocol; uint16_t address; uint16_t command; uint8_t flags; };
+struct irparams_struct { volatile uint8_t StateForISR; };
+
+// decode() returns true once for every frame put in with simIrFrame()
+class IRrecv
+{
+public:
+  void begin(uint8_t pin, bool feedback);
+  void registerReceiveCompleteCallback(void (*callback)(void));
+  bool decode();
+  void resume();
+  IRData          decodedIRData;
+  irparams_struct irparams;
+};
+extern IRrecv IrReceiver;
+void simIrFrame(decode_type_t protocol, uint16_t address, uint16_t command, uint8_t flags);
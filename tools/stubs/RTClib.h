@@ -0,0 +1,42 @@
+#pragma once
+#include <Arduino.h>
+
+class TimeSpan
+{
+public:
+  TimeSpan(int32_t seconds = 0) : seconds(seconds) {}
+  int32_t totalseconds() const { return seconds; }
+private:
+  int32_t seconds;
+};
+
+class DateTime
+{
+public:
+  DateTime(uint32_t unixTime = 0);
+  DateTime(uint16_t year, uint8_t month, uint8_t day, uint8_t hour = 0, uint8_t minute = 0, uint8_t second = 0);
+  DateTime(const char *date, const char *time);
+  uint16_t year()   const { return y; }
+  uint8_t  month()  const { return m; }
+  uint8_t  day()    const { return d; }
+  uint8_t  hour()   const { return hh; }
+  uint8_t  minute() const { return mm; }
+  uint8_t  second() const { return ss; }
+  uint32_t unixtime() const;
+  DateTime operator+(const TimeSpan &span) const { return DateTime(unixtime() + span.totalseconds()); }
+  DateTime operator-(const TimeSpan &span) const { return DateTime(unixtime() - span.totalseconds()); }
+private:
+  uint16_t y;
+  uint8_t  m, d, hh, mm, ss;
+};
+
+class RTC_DS1307
+{
+public:
+  bool     begin();
+  bool     isrunning();
+  void     adjust(const DateTime &dt);
+  DateTime now();
+};
+
+extern uint32_t simRtcTime;              // unix time (UTC) of the RTC
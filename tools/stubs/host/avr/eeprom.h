@@ -0,0 +1,9 @@
+#pragma once
+// EEPROM in RAM, see simEeprom, erased (0xFF) at start
+#include <stdint.h>
+#include <stddef.h>
+uint8_t eeprom_read_byte(const uint8_t *address);
+void    eeprom_update_byte(uint8_t *address, uint8_t value);
+void    eeprom_read_block(void *destination, const void *source, size_t length);
+void    eeprom_update_block(const void *source, void *destination, size_t length);
+extern uint8_t simEeprom[1024];
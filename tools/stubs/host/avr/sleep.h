@@ -0,0 +1,6 @@
+#pragma once
+#define SLEEP_MODE_IDLE 0
+void set_sleep_mode(int mode);
+void sleep_enable();
+void sleep_disable();
+void sleep_cpu();
@@ -0,0 +1,5 @@
+#pragma once
+#define WDTO_8S 9
+void wdt_enable(int timeout);
+void wdt_disable();
+void wdt_reset();
@@ -0,0 +1,257 @@
+/***********************************************************************
+ * Bodies of the stand-ins in tools/stubs, for the host tests and the 
+ * bench. On the host the registers, avr-libc and the clock are simulated;
+ * on the AVR only the libraries are replaced.
+ ***********************************************************************/
+#include <Arduino.h>
+#include <Adafruit_NeoPixel.h>
+#include <RTClib.h>
+#include <IRremote.h>
+
+unsigned long simMillis;
+unsigned long simMicros;
+byte          simPins[20];
+int           simAnalog;
+#ifndef __AVR__
+char          simSerialOut[4096];
+size_t        simSerialLength;
+#endif
+unsigned long simShows;
+void        (*simOnShow)(void);
+void        (*simOnGetPixels)(void);
+bool        (*simOnMillis)(void);
+uint32_t      simRtcTime;
+
+static uint8_t serialIn[64];
+static size_t  serialInLength;
+static size_t  serialInNext;
+
+/* Arduino core */
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t pin, uint8_t value) { simPins[pin] = value; }
+int  digitalRead(uint8_t pin)                 { return simPins[pin]; }
+int  analogRead(uint8_t)                      { return simAnalog; }
+void delay(unsigned long ms)
+{
+  for (; ms > 0; ms--)
+    {
+    simMillis++;
+    if (simOnMillis) simOnMillis();
+    }
+}
+unsigned long millis(void)                    { return simMillis; }
+unsigned long micros(void)                    { return simMillis * 1000 + simMicros; }
+void attachInterrupt(uint8_t, void (*)(void), int) {}
+
+/* Serial: output goes to simSerialOut, input comes from simSerialInput() */
+HardwareSerial Serial;
+
+void simSerialInput(const uint8_t *data, size_t length)
+{
+  if (length > sizeof(serialIn)) length = sizeof(serialIn);
+  memcpy(serialIn, data, length);
+  serialInLength = length;
+  serialInNext   = 0;
+}
+
+void HardwareSerial::begin(unsigned long)
+{
+#ifdef __AVR__
+  UBRR0  = 103;                   // 9600 baud at 16 MHz
+  UCSR0B = (1 << TXEN0);
+#endif
+}
+int    HardwareSerial::available() { return serialInLength - serialInNext; }
+int    HardwareSerial::read()      { return available() ? serialIn[serialInNext++] : -1; }
+size_t HardwareSerial::write(uint8_t b)
+{
+#ifdef __AVR__
+  while (!(UCSR0A & (1 << UDRE0))) ;
+  UDR0 = b;
+#else
+  if (simSerialLength < sizeof(simSerialOut) - 1) simSerialOut[simSerialLength++] = b;
+#endif
+  return 1;
+}
+void HardwareSerial::flush()
+{
+#ifdef __AVR__
+  while (!(UCSR0A & (1 << UDRE0))) ;
+#endif
+}
+size_t HardwareSerial::readBytes(uint8_t *buffer, size_t length)
+{
+  size_t n = 0;
+  while (n < length && available()) buffer[n++] = read();
+  return n;
+}
+size_t HardwareSerial::print(const char *s)
+{
+  size_t n = 0;
+  while (*s) n += write(*s++);
+  return n;
+}
+size_t HardwareSerial::print(char c) { return write(c); }
+size_t HardwareSerial::print(long n, int base)
+{
+  if (n < 0) return write('-') + print((unsigned long) -n, base);
+  return print((unsigned long) n, base);
+}
+size_t HardwareSerial::print(unsigned long n, int base)
+{
+  char digits[12];
+  byte i = 0;
+  do
+    {
+    digits[i++] = "0123456789ABCDEF"[n % base];
+    n /= base;
+    } while (n);
+  size_t written = 0;
+  while (i) written += write(digits[--i]);
+  return written;
+}
+size_t HardwareSerial::print(int n, int base)          { return print((long) n, base); }
+size_t HardwareSerial::print(unsigned int n, int base) { return print((unsigned long) n, base); }
+size_t HardwareSerial::println()                       { return write('\n'); }
+
+/* NeoPixel */
+Adafruit_NeoPixel::Adafruit_NeoPixel(uint16_t n, int16_t, uint16_t) : numLEDs(n), brightness(0)
+{
+  pixels = (uint8_t *) calloc(n, 3);
+}
+void     Adafruit_NeoPixel::begin() {}
+void     Adafruit_NeoPixel::show()  { simShows++; if (simOnShow) simOnShow(); }
+void     Adafruit_NeoPixel::clear() { memset(pixels, 0, numLEDs * 3); }
+uint8_t *Adafruit_NeoPixel::getPixels() const { if (simOnGetPixels) simOnGetPixels(); return pixels; }
+uint16_t Adafruit_NeoPixel::numPixels() const { return numLEDs; }
+uint8_t  Adafruit_NeoPixel::getBrightness() const { return brightness - 1; }
+
+// Stored brightness is one more than set, 0 means full, as in the library
+void Adafruit_NeoPixel::setBrightness(uint8_t b)
+{
+  uint8_t newBrightness = b + 1;
+  if (newBrightness == brightness) return;
+  uint8_t oldBrightness = brightness - 1;
+  uint16_t scale = (oldBrightness == 0) ? 0 : (b == 255) ? 65535 / oldBrightness : (((uint16_t) newBrightness << 8) - 1) / oldBrightness;
+  for (uint16_t i = 0; i < numLEDs * 3; i++) pixels[i] = (pixels[i] * scale) >> 8;
+  brightness = newBrightness;
+}
+
+void Adafruit_NeoPixel::setPixelColor(uint16_t n, uint32_t c)
+{
+  if (n >= numLEDs) return;
+  uint8_t r = c >> 16, g = c >> 8, b = c;
+  if (brightness)
+    {
+    r = (r * brightness) >> 8;
+    g = (g * brightness) >> 8;
+    b = (b * brightness) >> 8;
+    }
+  uint8_t *p = &pixels[n * 3];          // GRB
+  p[0] = g;
+  p[1] = r;
+  p[2] = b;
+}
+
+uint32_t Adafruit_NeoPixel::getPixelColor(uint16_t n) const
+{
+  if (n >= numLEDs) return 0;
+  const uint8_t *p = &pixels[n * 3];
+  return ((uint32_t) p[1] << 16) | ((uint32_t) p[0] << 8) | p[2];
+}
+
+/* RTClib, days from the civil calendar */
+static int32_t daysFromCivil(int32_t y, uint8_t m, uint8_t d)
+{
+  y -= m <= 2;
+  int32_t era = (y >= 0 ? y : y - 399) / 400;
+  int32_t yoe = y - era * 400;
+  int32_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  int32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+DateTime::DateTime(uint32_t t)
+{
+  ss = t % 60; t /= 60;
+  mm = t % 60; t /= 60;
+  hh = t % 24; t /= 24;
+  int32_t z   = t + 719468;
+  int32_t era = z / 146097;
+  int32_t doe = z - era * 146097;
+  int32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  int32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  int32_t mp  = (5 * doy + 2) / 153;
+  d = doy - (153 * mp + 2) / 5 + 1;
+  m = mp < 10 ? mp + 3 : mp - 9;
+  y = yoe + era * 400 + (m <= 2);
+}
+
+DateTime::DateTime(uint16_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t minute, uint8_t second)
+  : y(year < 2000 ? year + 2000 : year), m(month), d(day), hh(hour), mm(minute), ss(second) {}
+
+DateTime::DateTime(const char *, const char *) : y(2022), m(1), d(1), hh(0), mm(0), ss(0) {}
+
+uint32_t DateTime::unixtime() const
+{
+  return (uint32_t) daysFromCivil(y, m, d) * 86400UL + hh * 3600UL + mm * 60UL + ss;
+}
+
+bool     RTC_DS1307::begin()                    { return true; }
+bool     RTC_DS1307::isrunning()                { return true; }
+void     RTC_DS1307::adjust(const DateTime &dt) { simRtcTime = dt.unixtime(); }
+DateTime RTC_DS1307::now()                      { return DateTime(simRtcTime); }
+
+/* IRremote */
+IRrecv IrReceiver;
+static bool irFramePending;
+
+void simIrFrame(decode_type_t protocol, uint16_t address, uint16_t command, uint8_t flags)
+{
+  IrReceiver.decodedIRData.protocol = protocol;
+  IrReceiver.decodedIRData.address  = address;
+  IrReceiver.decodedIRData.command  = command;
+  IrReceiver.decodedIRData.flags    = flags;
+  irFramePending = true;
+}
+void IRrecv::begin(uint8_t, bool) {}
+void IRrecv::registerReceiveCompleteCallback(void (*)(void)) {}
+bool IRrecv::decode() { bool pending = irFramePending; irFramePending = false; return pending; }
+void IRrecv::resume() {}
+
+#ifndef __AVR__
+/* Registers and avr-libc */
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+
+volatile uint8_t  SREG, TCCR1A, TCCR1B, TIMSK1, TIFR1, MCUSR;
+volatile uint16_t TCNT1, ICR1, OCR1A;
+
+uint8_t simEeprom[1024];
+static struct EraseEeprom { EraseEeprom() { memset(simEeprom, 0xFF, sizeof(simEeprom)); } } eraseEeprom;
+
+uint8_t eeprom_read_byte(const uint8_t *address)          { return simEeprom[(size_t) address]; }
+void    eeprom_update_byte(uint8_t *address, uint8_t value) { simEeprom[(size_t) address] = value; }
+void    eeprom_read_block(void *destination, const void *source, size_t length)
+{
+  memcpy(destination, &simEeprom[(size_t) source], length);
+}
+void    eeprom_update_block(const void *source, void *destination, size_t length)
+{
+  memcpy(&simEeprom[(size_t) destination], source, length);
+}
+
+void set_sleep_mode(int) {}
+void sleep_enable()      {}
+void sleep_disable()     {}
+// sleeps until the hook reports an interrupt, or one ms without a hook
+void sleep_cpu()
+{
+  do simMillis++;
+  while (simOnMillis && !simOnMillis());
+}
+void wdt_enable(int)     {}
+void wdt_disable()       {}
+void wdt_reset()         {}
+#endif